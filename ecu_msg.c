@@ -1,13 +1,22 @@
-#include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 
-#include "app_simple_timer.h"
+#include "app_error.h"
+#include "app_scheduler.h"
+#include "app_timer.h"
 #include "ble_nus.h"
 #include "app_uart.h"
 #include "nrf_gpio.h"
 
 #include "ecu_msg.h"
+#include "ecu_profile.h"
+#include "ecu_stats.h"
+#include "flash_store.h"
+#include "rtt_sink.h"
+#include "sys_attr.h"
+#include "trace.h"
+#include "upstream.h"
 
 #define DASH_DISCONNECTED   0
 #define DASH_CONNECTED      1
@@ -17,20 +26,137 @@
 
 #define BREAK_TYPE_LO_BAUD  0
 
-#define WAIT_BEFORE_PULSE   10
-#define WAIT_PULSE          70
-#define WAIT_AFTER_PULSE    130
-#define WAIT_AFTER_WAKEUP   50
-#define INTERVAL_MAIN       50
+#define INTERVAL_STATS      50
 
-// app_timer configured to run at 250 kHz
-#define TIMER_MS(ms)        ((250000 * ms) / 1000)
+#define LED_PERIOD          5000
+#define LED_ON_IDLE         100
+#define LED_ON_CONNECTED    500
+#define LED_COMMS           50
+
+// One shot deadlines, each one runs on its own app_timer instance
+#define DL_SESSION          0
+#define DL_INIT             1
+#define DL_POLL             2
+#define DL_TIMEOUT          3
+#define DL_STATS            4
+#define DL_LED_RED          5
+#define DL_LED_GREEN        6
+#define DL_GAP              7
+#define DL_COUNT            8
+
+#define DTC_OP_NONE         0
+#define DTC_OP_READ         1
+#define DTC_OP_CLEAR        2
+
+#define DTC_CURRENT         0x74
+#define DTC_PAST            0x73
+#define DTC_CLEAR           0x60
+#define DTC_MAX_INDEX       0x0b
+#define DTC_MAX_RETRY       3
+
+// Longest ECU frame, length byte covers the whole frame
+#define MSG_MAX_LENGTH      255
+
+// Raw bytes are kept at data[1] of a pool frame, longer tables are
+// forwarded in chunks of this size while they are received
+#define MSG_CHUNK           32
+
+// K-line idle this long inside a frame means the rest of it was lost (ISO 14230 P1 max)
+#define MSG_IDLE_GAP        20
+
+// Failed request is sent again once the rest of the bad frame has passed
+#define REQ_RETRY_DELAY     40
+#define REQ_MAX_RETRY       2
+
+// No response this long after a request counts as a bad frame. Once the response
+// length byte arrives the timeout is moved to the end of the frame at the K-line
+// baudrate, stalls inside the frame are caught by MSG_IDLE_GAP.
+#define REQ_TIMEOUT         300
+
+// Gap between poll cycles in ms, shortened by a step after each clean cycle
+// and doubled after errors, never longer than the profile poll interval
+#define POLL_GAP_START      250
+#define POLL_GAP_STEP       25
+
+// Poll gap at or below POLL_GAP_START asks for the streaming connection interval,
+// at or above this for the idle one, in between the current one is kept
+#define POLL_GAP_SLOW       1000
+
+// Most free frames a table waits for before it is requested, well below the pool
+// size so the frame held by the parser and queued records never block a long table
+#define POLL_FRAMES_MAX     (FRAME_POOL_SIZE / 2)
+
+// With all SoftDevice buffers in use, a notification waiting longer than this means congestion
+#define POLL_DELAY_HIGH     100
+
+// Received bytes wait here for the main loop, size is a power of two
+#define RX_RING_SIZE        64
+
+// app_timer runs on RTC1 at 32768 Hz, prescaler 0
+#define RTC_MS(ms)          ((32768 * (ms)) / 1000)
 
 static const unsigned char REQ_WAKEUP[] = {0xfe, 0x04, 0xff, 0xff};
-static const unsigned char REQ_INIT[] = {0x72, 0x05, 0x00, 0xf0, 0x99};
 
-static const unsigned char REQ_READ_TABLE_11[] = {0x72, 0x05, 0x71, 0x11, 0x07};
-static const unsigned char REQ_READ_TABLE_D1[] = {0x72, 0x05, 0x71, 0xd1, 0x47};
+#if ECU_MAX_POLL > STATS_MAX_TABLES
+#error "Latency stats need a slot for each polled table"
+#endif
+
+#if 2 * MSG_CHUNK + 12 > FRAME_DATA_SIZE
+#error "Hex of a full chunk and sample suffix must fit in a pool frame"
+#endif
+
+// '!' + type + hex of n data bytes
+#define DASH_REC_LENGTH(n)  (2 + 2 * (n))
+
+// Counters per '!S' record, the record starts with the index of its first counter
+#define STATS_REC_COUNTERS  8
+#define STATS_COUNTERS      (offsetof(ecu_stats_t, latency) / sizeof(uint32_t))
+
+#if DASH_REC_LENGTH(1 + 4 * STATS_REC_COUNTERS) > FRAME_DATA_SIZE
+#error "Stats counter record must fit in a pool frame"
+#endif
+
+#if DASH_REC_LENGTH(1 + 2 * STATS_HIST_BUCKETS) > FRAME_DATA_SIZE
+#error "Latency histogram record must fit in a pool frame"
+#endif
+
+#if (REQ_MAX_RETRY + 1) * REQ_TIMEOUT + REQ_MAX_RETRY * REQ_RETRY_DELAY > PROFILE_POLL_MIN
+#error "A request and its retries must fit in the shortest profile poll interval"
+#endif
+
+#if 10000 / PROFILE_BAUD_MIN >= MSG_IDLE_GAP
+#error "A byte at the lowest profile baudrate must be shorter than the frame idle gap"
+#endif
+
+#if DASH_REC_LENGTH(MSG_CHUNK - 3) > FRAME_DATA_SIZE
+#error "DTC record must fit in a pool frame"
+#endif
+
+#if DASH_REC_LENGTH(1 + PROFILE_UPLOAD_SIZE + 1 + ECU_MAX_POLL) > FRAME_DATA_SIZE
+#error "Profile record must fit in a pool frame"
+#endif
+
+#define SCAN_MAGIC          0x5343414e
+#define SCAN_CACHE_SIZE     4
+#define SCAN_ID_TABLE       0x00
+#define SCAN_TIMEOUT        150
+
+// Tables found from one ECU
+typedef struct
+{
+    uint32_t ecu_id;
+    uint8_t count;
+    uint8_t tables[ECU_MAX_TABLES];
+    uint8_t lengths[ECU_MAX_TABLES];
+} scan_map_t;
+
+// Flash record of recently seen ECUs
+typedef struct
+{
+    uint32_t magic;
+    uint32_t next;
+    scan_map_t maps[SCAN_CACHE_SIZE];
+} scan_cache_t;
 
 static const char TO_HEX[] = "0123456789ABCDEF";
 
@@ -40,16 +166,68 @@ static int main_watchdog = 0;
 static int msg_state = MSG_STM_IDLE;
 static int msg_index = 0;
 static int msg_length = 0;
-static unsigned char msg_buf[32];
-static char str_buf[64];
-static int blink_comms = 0;
+static int msg_fill = 0;
+static int msg_sum = 0;
+static int msg_streamed = 0;
+static int msg_lost = 0;
+static unsigned char msg_head[4];
+static frame_t *msg_frame = NULL;
+static unsigned char *msg_buf = NULL;
+static uint32_t msg_time = 0;
+static uint32_t msg_start = 0;
+static uint32_t msg_last = 0;
+static uint32_t rx_time = 0;
+static uint32_t req_time = 0;
+static unsigned char req_last[MSG_CHUNK];
+static int req_retry = 0;
+static int req_waiting = 0;
+// Requests given up after all retries in a row, ECU has gone quiet
+static int req_giveup = 0;
+static uint32_t echo_time = 0;
+static uint16_t sample_seq = 0;
+
+static volatile int dash_state = DASH_DISCONNECTED;
+static int init_step = 0;
+static int led_red_on = 0;
+
+APP_TIMER_DEF(session_timer);
+APP_TIMER_DEF(init_timer);
+APP_TIMER_DEF(poll_timer);
+APP_TIMER_DEF(timeout_timer);
+APP_TIMER_DEF(stats_timer);
+APP_TIMER_DEF(led_red_timer);
+APP_TIMER_DEF(led_green_timer);
+APP_TIMER_DEF(gap_timer);
+
+static app_timer_id_t dl_timers[DL_COUNT];
+
+static unsigned char rx_bytes[RX_RING_SIZE];
+static uint32_t rx_times[RX_RING_SIZE];
+static volatile unsigned int rx_head = 0;
+static volatile unsigned int rx_tail = 0;
+static volatile int rx_pending = 0;
 
-#define DBG(...) {\
-  snprintf(str_buf, sizeof(str_buf), __VA_ARGS__);\
-  write_upstream(str_buf, strlen(str_buf));\
-}\
+static unsigned char poll_tables[ECU_MAX_POLL];
+static uint8_t poll_len[ECU_MAX_POLL];
+static int poll_count = 0;
+static int poll_index = 0;
+static int poll_gap = POLL_GAP_START;
+static int poll_err = 0;
+static uint32_t poll_err_seen = 0;
 
-static void init_timer_handler(void * p_context);
+static scan_map_t scan_map;
+static scan_cache_t scan_cache;
+static int scan_table = 0;
+static int scan_save_pending = 0;
+
+static volatile int dtc_op = DTC_OP_NONE;
+static unsigned char dtc_kind = DTC_CURRENT;
+static unsigned char dtc_index = 1;
+static int dtc_wait = 0;
+static int dtc_preempt = 0;
+static int dtc_retry = 0;
+
+static volatile int stats_part = -1;
 
 #if BREAK_TYPE_LO_BAUD == 1
 
@@ -63,7 +241,7 @@ static void break_downstream(int state)
     }
     else
     {
-        NRF_UART0->BAUDRATE = ECU_BAUDRATE;
+        NRF_UART0->BAUDRATE = ecu_profile_baudrate();
     }
 }
 
@@ -86,18 +264,31 @@ static void break_downstream(int state)
 
 #endif
 
-static void write_upstream(const char *msg, int n)
+// Each deadline has its own RTC1 timer, restarting replaces the pending timeout
+static void deadline_set(int id, uint32_t ms)
 {
-    int len = n;
-    uint8_t *ptr = (uint8_t *)msg;
+    uint32_t err_code;
+    uint32_t ticks = RTC_MS(ms);
 
-    while (len)
+    if (ticks < APP_TIMER_MIN_TIMEOUT_TICKS)
     {
-        int sz = len < BLE_NUS_MAX_DATA_LEN ? len : BLE_NUS_MAX_DATA_LEN;
-        ble_nus_string_send(nus_get_service(), ptr, sz);
-        len -= sz;
-        ptr += sz;
+        ticks = APP_TIMER_MIN_TIMEOUT_TICKS;
     }
+
+    // Full op queue would lose the deadline, APP_TIMER_OP_QUEUE_SIZE is too small
+    err_code = app_timer_stop(dl_timers[id]);
+    APP_ERROR_CHECK(err_code);
+
+    err_code = app_timer_start(dl_timers[id], ticks, (void *) id);
+    APP_ERROR_CHECK(err_code);
+}
+
+static void deadline_clear(int id)
+{
+    uint32_t err_code;
+
+    err_code = app_timer_stop(dl_timers[id]);
+    APP_ERROR_CHECK(err_code);
 }
 
 static void write_downstream(const unsigned char *msg, int n)
@@ -115,304 +306,1331 @@ static int to_hex(char *ptr, unsigned char v)
     return 2;
 }
 
-static int verify_msg_csum(unsigned char *msg)
+static unsigned char msg_csum(const unsigned char *msg, int len)
 {
-    //DBG("verify_msg_csum");
     int csum = 0;
-    int len = msg[1];
 
-    for (int i = 0; i < len-1; i++)
+    for (int i = 0; i < len; i++)
     {
         csum += msg[i];
     }
 
-    csum = (0x100 - csum) & 0xff;
-    return csum == msg[len-1];
+    return (0x100 - csum) & 0xff;
 }
 
-static void reset_msg_stm(void)
+// Bytes of a received frame kept in msg_buf, longer frames are cut at MSG_CHUNK
+static int msg_kept_length(const unsigned char *msg)
 {
-    //DBG("reset_msg_stm");
-    msg_index = 0;
-    msg_length = 0;
-    msg_state = MSG_STM_IDLE;
+    return msg[1] < MSG_CHUNK ? msg[1] : MSG_CHUNK;
 }
 
-static int do_msg_stm(unsigned char rx)
+static int verify_msg_csum(unsigned char *msg)
 {
-    int res = MSG_STATUS_NONE;
-
-    switch (msg_state)
-    {
-    case MSG_STM_IDLE:
-        blink_comms = 1;
-        msg_buf[msg_index++] = rx;
-        msg_state = MSG_STM_LENGTH;
-        break;
+    int len = msg[1];
 
-    case MSG_STM_LENGTH:
-        msg_length = rx;
+    return msg_csum(msg, len-1) == msg[len-1];
+}
 
-        if (msg_length >= 3 && msg_length <= sizeof(msg_buf))
-        {
-            msg_buf[msg_index++] = rx;
-            msg_state = MSG_STM_DATA;
-        }
-        else
-        {
-            res = MSG_STATUS_ERR;
-            reset_msg_stm();
-        }
-        break;
+// Data of a forwarded frame: ':' + hex of the first chunk, '+' + hex of later
+// chunks of a long table. Encoded in place, backwards from the end so each
+// byte is read before its hex overwrites it. Returns end of the hex.
+static char *msg_encode(void)
+{
+    uint8_t *data = msg_frame->data;
 
-    case MSG_STM_DATA:
-        msg_buf[msg_index++] = rx;
-        if (msg_index >= msg_length)
-        {
-            res = verify_msg_csum(msg_buf) ? MSG_STATUS_OK : MSG_STATUS_ERR;
-            reset_msg_stm();
-        }
-        break;
+    for (int i = msg_fill - 1; i >= 0; i--)
+    {
+        to_hex((char *) &data[1 + 2*i], data[1 + i]);
     }
+    data[0] = msg_streamed ? '+' : ':';
 
-    return res;
+    return (char *) &data[1 + 2*msg_fill];
 }
 
-static void ecu_send_req(const unsigned char *msg)
+// Hands msg_frame to upstream queue, msg_buf moves to next
+static void msg_forward(frame_t *next, char *end)
 {
-    write_downstream(msg, msg[1]);
+    msg_frame->length = end - (char *) msg_frame->data;
+
+    rtt_sink_write(msg_frame->data, msg_frame->length);
+    upstream_send(msg_frame);
+    msg_frame = next;
+    msg_buf = &next->data[1];
+    msg_fill = 0;
 }
 
-static void dash_send_msg(const unsigned char *msg)
+// Long table, forward the bytes received so far while the rest arrives
+static void dash_send_chunk(void)
 {
-    char *ptr = str_buf;
-    *ptr++ = ':';
-    for (int i = 0; i < msg[1]; i++)
+    frame_t *next = msg_lost ? NULL : frame_alloc();
+
+    if (next == NULL)
     {
-        ptr += to_hex(ptr, msg[i]);
+        // Rest of the frame is dropped too, see dash_send_msg
+        msg_lost = 1;
+        msg_fill = 0;
+        return;
     }
-    write_upstream(str_buf, 1+msg[1]*2);
+
+    msg_forward(next, msg_encode());
+    msg_streamed = 1;
 }
 
-static int ecu_process_msg(unsigned char *msg)
+// Streamed frame failed its checksum: '*' + sequence number, dash drops the chunks
+static void dash_send_abort(void)
 {
-    // Ecu response
-    if (msg[0] == 0x02)
-    {
-        //DBG("valid message");
-        switch (msg[2])
-        {
-        // Init OK
-        case 0x00:
-            ecu_send_req(REQ_READ_TABLE_11);
-            break;
+    frame_t *frame = frame_alloc();
+    char *ptr;
 
-        // Table contents
-        case 0x71:
-            dash_send_msg(msg);
-            if (msg[3] == 0x11)
-            {
-                ecu_send_req(REQ_READ_TABLE_D1);
-            }
+    if (frame != NULL)
+    {
+        ptr = (char *) frame->data;
+        *ptr++ = '*';
+        ptr += to_hex(ptr, sample_seq >> 8);
+        ptr += to_hex(ptr, sample_seq);
+        frame->length = ptr - (char *) frame->data;
 
-            if (msg[3] == 0xD1)
-            {
-                return MAIN_STM_REQ_11;
-            }
-            break;
-        }
+        rtt_sink_write(frame->data, frame->length);
+        upstream_send(frame);
     }
 
-    return MAIN_STM_RUN;
+    sample_seq++;
+    msg_streamed = 0;
 }
 
-int do_main_stm(int reason, unsigned char rx)
+// Table sample to dash: ':' + frame + '@' + sequence number + RTC1 ticks,
+// a long table ends with its last '+' chunk followed by the same suffix.
+// Frame is encoded in place and handed to upstream queue, msg_buf
+// moves to a fresh frame. Frame contents must not be used after this call.
+static void dash_send_msg(void)
 {
-    static int cnt = 0;
+    frame_t *next = msg_lost ? NULL : frame_alloc();
+    char *ptr;
 
-    // State machine init
-    if (reason == MAIN_REASON_INIT)
+    if (next == NULL)
     {
-        main_state = MAIN_STM_NONE;
-        main_watchdog = 0;
-        cnt = 0;
-        return 1;
+        // Dropped, sequence number shows the gap to dash and the next ':'
+        // discards any chunks already sent
+        sample_seq++;
+        return;
     }
 
-    // Periodic actions every 2.5 seconds when in running state
-    if (reason == MAIN_REASON_NONE && main_state >= MAIN_STM_RUN)
+    ptr = msg_encode();
+    *ptr++ = '@';
+    ptr += to_hex(ptr, sample_seq >> 8);
+    ptr += to_hex(ptr, sample_seq);
+    ptr += to_hex(ptr, msg_time >> 16);
+    ptr += to_hex(ptr, msg_time >> 8);
+    ptr += to_hex(ptr, msg_time);
+    sample_seq++;
+    ecu_stats_sample(msg_time);
+
+    msg_forward(next, ptr);
+}
+
+static void reset_msg_stm(void)
+{
+    msg_index = 0;
+    msg_length = 0;
+    msg_fill = 0;
+    msg_sum = 0;
+    msg_streamed = 0;
+    msg_lost = 0;
+    msg_state = MSG_STM_IDLE;
+}
+
+// Header is kept apart, msg_buf only holds the current chunk of a long table
+static void msg_store(unsigned char rx)
+{
+    if (msg_index < sizeof(msg_head))
     {
-        if (++cnt < 50)
-        {
-            return 1;
-        }
-        cnt = 0;
+        msg_head[msg_index] = rx;
     }
 
-    switch (main_state)
+    // Bytes past a full chunk that is not forwarded only count for the checksum
+    if (msg_fill < MSG_CHUNK)
     {
-    case MAIN_STM_NONE:
-        // Empty
-        break;
+        msg_buf[msg_fill++] = rx;
+    }
 
-    case MAIN_STM_RUN:
-        if (reason == MAIN_REASON_RX)
-        {
-            int res = do_msg_stm(rx);
+    msg_index++;
+    msg_sum += rx;
+}
 
-            if (res == MSG_STATUS_OK)
-            {
-                main_state = ecu_process_msg(msg_buf);
-                main_watchdog = 0;
-            }
+// Start of the last frame, msg_buf has moved on if chunks were forwarded or dropped
+static unsigned char *msg_frame_head(void)
+{
+    return msg_streamed || msg_lost ? msg_head : msg_buf;
+}
 
-            if (res == MSG_STATUS_ERR)
-            {
-                main_state = MAIN_STM_REQ_11;
-                main_watchdog = 0;
-            }
-        }
-        else // every ~2.5 seconds
+// Looks for the next plausible frame start in bytes still in msg_buf.
+// Keeps a partial frame if one fits, returns OK if a whole frame fits.
+static int msg_resync(void)
+{
+    if (msg_streamed)
+    {
+        dash_send_abort();
+    }
+
+    for (int start = 1; start < msg_fill; start++)
+    {
+        unsigned char *msg = msg_buf + start;
+        int count = msg_fill - start;
+        int length = count > 1 ? msg[1] : 0;
+
+        if (count > 1 && (length < 3 || length > MSG_MAX_LENGTH || length < count))
         {
-            if (++main_watchdog > MAIN_WATCHDOG_MAX)
-            {
-                DBG("#reinit");
-                return 0;
-            }
+            continue;
         }
-        break;
 
-    case MAIN_STM_REQ_11:
-        // after ~2.5 seconds
-        if (reason == MAIN_REASON_NONE)
+        if (count > 1 && length == count && !verify_msg_csum(msg))
         {
-            ecu_send_req(REQ_READ_TABLE_11);
-            main_state = MAIN_STM_RUN;
+            continue;
         }
-        break;
-    }
 
-    return 1;
-}
-
-static void blink_status(void)
-{
-    static int cnt = 0;
+        memmove(msg_buf, msg, count);
+        reset_msg_stm();
 
-    if (nus_get_conn_handle() == BLE_CONN_HANDLE_INVALID)
-    {
-        if (cnt == 0)
+        for (int i = 0; i < count; i++)
         {
-            nrf_gpio_pin_set(RUUVI_LED_RED);
+            msg_store(msg_buf[i]);
         }
-        if (cnt == 98)
+        msg_length = length;
+
+        if (count == 1)
         {
-            nrf_gpio_pin_clear(RUUVI_LED_RED);
+            msg_state = MSG_STM_LENGTH;
         }
-    }
-    else
-    {
-        if (cnt == 0)
+        else if (count < length)
         {
-            nrf_gpio_pin_set(RUUVI_LED_RED);
+            msg_state = MSG_STM_DATA;
         }
-        if (cnt == 90)
+        else
         {
-            nrf_gpio_pin_clear(RUUVI_LED_RED);
+            msg_time = rx_time;
+            return MSG_STATUS_OK;
         }
+
+        return MSG_STATUS_NONE;
     }
 
-    cnt = (cnt+1) % 100;
+    reset_msg_stm();
+    return MSG_STATUS_NONE;
+}
+
+// Line went idle before the frame was complete
+static int msg_idle(void)
+{
+    int res;
 
-    // Blink green if communicating with ECU
-    if (blink_comms)
+    if (msg_state == MSG_STM_IDLE)
     {
-        nrf_gpio_pin_clear(RUUVI_LED_GREEN);
-        blink_comms = 0;
+        return MSG_STATUS_NONE;
     }
-    else
+
+    ecu_stats.frame_gap++;
+
+    // A whole frame may still sit behind the lost bytes
+    res = msg_resync();
+    if (res != MSG_STATUS_OK)
     {
-        nrf_gpio_pin_set(RUUVI_LED_GREEN);
+        reset_msg_stm();
+        res = MSG_STATUS_ERR;
+    }
+
+    return res;
+}
+
+// Response to the last request has started, its timeout now runs to the end of
+// the frame: 10 bits per byte at the K-line baudrate and one idle gap of slack
+static void req_timeout_extend(void)
+{
+    uint32_t frame_ms;
+
+    if (!req_waiting || msg_head[0] != 0x02 ||
+        (main_state != MAIN_STM_RUN && main_state != MAIN_STM_SCAN))
+    {
+        return;
     }
+
+    req_waiting = 0;
+    frame_ms = (msg_length * 10000) / ecu_profile()->baud;
+    deadline_set(DL_TIMEOUT, frame_ms + MSG_IDLE_GAP);
 }
 
-static void main_timer_handler(void * p_context)
+// Completed frame stays in msg_head and msg_buf until the next one starts
+static int do_msg_stm(unsigned char rx)
 {
-    static int prev_state = DASH_DISCONNECTED;
+    int res = MSG_STATUS_NONE;
+    uint32_t gap;
 
-    blink_status();
+    // Gap deadline did not run before this byte, drop the stale frame here
+    app_timer_cnt_diff_compute(rx_time, msg_last, &gap);
+    msg_last = rx_time;
+
+    if (msg_state != MSG_STM_IDLE && gap > RTC_MS(MSG_IDLE_GAP))
+    {
+        ecu_stats.frame_gap++;
+        if (msg_streamed)
+        {
+            dash_send_abort();
+        }
+        msg_state = MSG_STM_IDLE;
+    }
 
-    if (nus_get_conn_handle() != BLE_CONN_HANDLE_INVALID)
+    switch (msg_state)
     {
-        if (prev_state == DASH_DISCONNECTED)
+    case MSG_STM_IDLE:
+        msg_start = rx_time;
+
+        // Blink green if communicating with ECU
+        nrf_gpio_pin_clear(RUUVI_LED_GREEN);
+        deadline_set(DL_LED_GREEN, LED_COMMS);
+        reset_msg_stm();
+        msg_store(rx);
+        msg_state = MSG_STM_LENGTH;
+        break;
+
+    case MSG_STM_LENGTH:
+        msg_length = rx;
+        msg_store(rx);
+
+        if (msg_length >= 3 && msg_length <= MSG_MAX_LENGTH)
         {
-            do_main_stm(MAIN_REASON_INIT, 0);
-            app_simple_timer_start(APP_SIMPLE_TIMER_MODE_SINGLE_SHOT, init_timer_handler, TIMER_MS(WAIT_BEFORE_PULSE), (void *) 0);
+            msg_state = MSG_STM_DATA;
+            req_timeout_extend();
         }
         else
         {
-            // Restart if main state machine returns 0
-            if (!do_main_stm(MAIN_REASON_NONE, 0))
+            ecu_stats.length_err++;
+            res = MSG_STATUS_ERR;
+        }
+        break;
+
+    case MSG_STM_DATA:
+        // Table data goes upstream as it arrives, other frames are only checked
+        if (msg_fill == MSG_CHUNK && main_state == MAIN_STM_RUN &&
+            msg_head[0] == 0x02 && msg_head[2] == 0x71)
+        {
+            dash_send_chunk();
+        }
+
+        msg_store(rx);
+        if (msg_index >= msg_length)
+        {
+            // RTC1 ticks when the last byte arrived
+            msg_time = rx_time;
+
+            // Sum over the whole frame including checksum byte is zero
+            if (msg_sum & 0xff)
+            {
+                ecu_stats.csum_err++;
+                res = MSG_STATUS_ERR;
+            }
+            else
             {
-                prev_state = DASH_DISCONNECTED;
-                return;
+                res = MSG_STATUS_OK;
+                msg_state = MSG_STM_IDLE;
             }
         }
-
-        prev_state = DASH_CONNECTED;
+        break;
     }
-    else
+
+    // Bad frame, the real one may start somewhere inside it
+    if (res == MSG_STATUS_ERR && msg_resync() == MSG_STATUS_OK)
     {
-        prev_state = DASH_DISCONNECTED;
+        res = MSG_STATUS_OK;
     }
+
+    return res;
 }
 
-static void init_timer_handler(void * p_context)
+static void ecu_send_req(const unsigned char *msg)
 {
-    int state = (int) p_context;
-
-    switch (state)
+    // Kept for a retry after a bad response
+    if (msg != req_last)
     {
-    case 0:
-        break_downstream(1);
-        app_simple_timer_start(APP_SIMPLE_TIMER_MODE_SINGLE_SHOT, init_timer_handler, TIMER_MS(WAIT_PULSE), (void *) 1);
-        break;
-    case 1:
-        break_downstream(0);
-        app_simple_timer_start(APP_SIMPLE_TIMER_MODE_SINGLE_SHOT, init_timer_handler, TIMER_MS(WAIT_AFTER_PULSE), (void *) 2);
-        break;
-    case 2:
-        ecu_send_req(REQ_WAKEUP);
-        app_simple_timer_start(APP_SIMPLE_TIMER_MODE_SINGLE_SHOT, init_timer_handler, TIMER_MS(WAIT_AFTER_WAKEUP), (void *) 3);
-        break;
-    case 3:
-        ecu_send_req(REQ_INIT);
-        main_state = MAIN_STM_RUN;
-        app_simple_timer_start(APP_SIMPLE_TIMER_MODE_REPEATED, main_timer_handler, TIMER_MS(INTERVAL_MAIN), NULL);
-        break;
+        memcpy(req_last, msg, msg[1]);
     }
+
+    app_timer_cnt_get(&req_time);
+    write_downstream(msg, msg[1]);
+    req_waiting = 1;
+
+    // Cleared by the response, table scan sets its own timeout after this
+    deadline_set(DL_TIMEOUT, REQ_TIMEOUT);
 }
 
-void ecu_init(void)
+static void ecu_send_cmd(unsigned char cmd, unsigned char arg)
 {
-    nrf_gpio_cfg_input(RUUVI_UART_RX, NRF_GPIO_PIN_PULLUP);
-    nrf_gpio_cfg(
-        RUUVI_UART_TX,
-        NRF_GPIO_PIN_DIR_OUTPUT,
-        NRF_GPIO_PIN_INPUT_DISCONNECT,
-        NRF_GPIO_PIN_NOPULL,
-        NRF_GPIO_PIN_H0S1,
-        NRF_GPIO_PIN_NOSENSE);
+    unsigned char req[5] = {0x72, 0x05, cmd, arg, 0x00};
 
-    nrf_gpio_pin_write(RUUVI_UART_TX, 1);
+    req[4] = msg_csum(req, 4);
+    ecu_send_req(req);
+}
 
-    nrf_gpio_cfg_output(RUUVI_LED_RED);
-    nrf_gpio_cfg_output(RUUVI_LED_GREEN);
+static void ecu_send_table_req(unsigned char table)
+{
+    ecu_send_cmd(0x71, table);
+}
 
-    nrf_gpio_pin_set(RUUVI_LED_RED);
+// Record to dash: '!', record type and data as hex
+static void dash_send_record(char type, const unsigned char *data, int n)
+{
+    frame_t *frame;
+    char *ptr;
+
+    if (DASH_REC_LENGTH(n) > FRAME_DATA_SIZE)
+    {
+        return;
+    }
+
+    frame = frame_alloc();
+    if (frame == NULL)
+    {
+        return;
+    }
+
+    ptr = (char *) frame->data;
+    *ptr++ = '!';
+    *ptr++ = type;
+    for (int i = 0; i < n; i++)
+    {
+        ptr += to_hex(ptr, data[i]);
+    }
+    frame->length = DASH_REC_LENGTH(n);
+    rtt_sink_write(frame->data, frame->length);
+    upstream_send(frame);
+}
+
+// Stats to dash one record per call, returns next part or -1 when done
+static int dash_send_stats(int part)
+{
+    ecu_latency_t *lat = &ecu_stats.latency;
+    int counter_recs = (STATS_COUNTERS + STATS_REC_COUNTERS - 1) / STATS_REC_COUNTERS;
+
+    // Counters split over records, first one refreshes the derived values
+    if (part < counter_recs)
+    {
+        unsigned char rec[1 + 4 * STATS_REC_COUNTERS];
+        int first = part * STATS_REC_COUNTERS;
+        int count = STATS_COUNTERS - first;
+
+        if (count > STATS_REC_COUNTERS)
+        {
+            count = STATS_REC_COUNTERS;
+        }
+        if (part == 0)
+        {
+            ecu_stats_update();
+        }
+
+        rec[0] = first;
+        memcpy(rec+1, (const uint32_t *) &ecu_stats + first, 4 * count);
+        dash_send_record(DASH_REC_STATS, rec, 1 + 4 * count);
+        return part + 1;
+    }
+
+    // Two histograms for each used table slot
+    while (part - counter_recs < 2 * STATS_MAX_TABLES)
+    {
+        int slot = (part - counter_recs) / 2;
+
+        if (lat->table[slot] != 0)
+        {
+            unsigned char rec[1 + sizeof(lat->total[0])];
+            int total = (part - counter_recs) & 1;
+
+            rec[0] = lat->table[slot];
+            memcpy(rec+1, total ? lat->total[slot] : lat->turnaround[slot], sizeof(lat->total[0]));
+            dash_send_record(total ? DASH_REC_TOTAL : DASH_REC_TURNAROUND, rec, sizeof(rec));
+            return part + 1;
+        }
+
+        part++;
+    }
+
+    return -1;
+}
+
+// Table is skipped during BLE congestion: not enough free frames for the chunks
+// of its last sample, or notifications stuck behind full SoftDevice buffers.
+// A chunk takes ~30 ms on the K-line and a draining queue frees frames meanwhile,
+// so long tables only need part of the pool up front. Large tables drop out first
+// and come back as soon as the queue drains.
+static int poll_due(int i)
+{
+    int frames = poll_len[i] / MSG_CHUNK + 1;
+
+    if (frames > POLL_FRAMES_MAX)
+    {
+        frames = POLL_FRAMES_MAX;
+    }
+
+    if (frame_available() < frames)
+    {
+        return 0;
+    }
+
+    return upstream_tx_free() > 0 || upstream_delay() < RTC_MS(POLL_DELAY_HIGH);
+}
+
+// First table from index on that is due, poll_count if none
+static int poll_next(int index)
+{
+    while (index < poll_count && !poll_due(index))
+    {
+        ecu_stats.poll_skip++;
+        index++;
+    }
+
+    return index;
+}
+
+// Requests the first table due, if all are skipped look again after a gap step.
+// Without tables init was never answered, the housekeeping tick starts over.
+static int poll_start(void)
+{
+    poll_index = poll_next(0);
+
+    if (poll_index >= poll_count)
+    {
+        poll_index = 0;
+        if (poll_count > 0)
+        {
+            deadline_set(DL_TIMEOUT, POLL_GAP_STEP);
+        }
+        return MAIN_STM_POLL;
+    }
+
+    ecu_send_table_req(poll_tables[poll_index]);
+    return MAIN_STM_RUN;
+}
+
+// K-line errors seen by parser and UART so far
+static uint32_t poll_errors(void)
+{
+    return ecu_stats.csum_err + ecu_stats.length_err + ecu_stats.frame_gap + ecu_stats.uart_comm_err;
+}
+
+// Additive increase of poll rate while the line is clean, multiplicative decrease on errors
+static void poll_adapt(void)
+{
+    uint32_t errors = poll_errors();
+
+    if (poll_err || errors != poll_err_seen)
+    {
+        poll_gap = 2 * poll_gap + POLL_GAP_STEP;
+        if (poll_gap > ecu_profile()->interval_poll)
+        {
+            poll_gap = ecu_profile()->interval_poll;
+        }
+        trace_event(TRACE_POLL_BACKOFF, poll_gap);
+    }
+    else
+    {
+        poll_gap = poll_gap > POLL_GAP_STEP ? poll_gap - POLL_GAP_STEP : 0;
+    }
+
+    poll_err = 0;
+    poll_err_seen = errors;
+}
+
+// Poll cycle done, next one starts after the gap
+static int poll_wait(void)
+{
+    poll_adapt();
+
+    if (poll_gap <= POLL_GAP_START)
+    {
+        conn_params_streaming(1);
+    }
+    else if (poll_gap >= POLL_GAP_SLOW)
+    {
+        conn_params_streaming(0);
+    }
+
+    deadline_set(DL_TIMEOUT, poll_gap);
+    return MAIN_STM_POLL;
+}
+
+static void dtc_finish(int ok)
+{
+    unsigned char res = ok;
+
+    if (dtc_op == DTC_OP_CLEAR)
+    {
+        dash_send_record(DASH_REC_DTC_CLEAR, &res, 1);
+    }
+    else
+    {
+        // Kind 0 ends the DTC listing
+        res = 0;
+        dash_send_record(DASH_REC_DTC, &res, 1);
+    }
+
+    dtc_op = DTC_OP_NONE;
+}
+
+static void dtc_cancel(void)
+{
+    dtc_wait = 0;
+    dtc_preempt = 0;
+
+    if (dtc_op != DTC_OP_NONE && ++dtc_retry > DTC_MAX_RETRY)
+    {
+        dtc_finish(0);
+    }
+}
+
+// Continue DTC transaction in the gap between poll cycles
+static int dtc_next(void)
+{
+    if (dtc_op == DTC_OP_NONE)
+    {
+        return poll_wait();
+    }
+
+    if (dtc_op == DTC_OP_CLEAR)
+    {
+        ecu_send_cmd(DTC_CLEAR, 0x03);
+    }
+    else
+    {
+        ecu_send_cmd(dtc_kind, dtc_index);
+    }
+
+    dtc_wait = 1;
+    return MAIN_STM_RUN;
+}
+
+static int dtc_process(const unsigned char *msg)
+{
+    if (!dtc_wait)
+    {
+        return MAIN_STM_RUN;
+    }
+
+    dtc_wait = 0;
+    dtc_retry = 0;
+
+    if (msg[2] == DTC_CLEAR)
+    {
+        dtc_finish(1);
+    }
+    else if (msg[2] == dtc_kind && msg[3] == dtc_index)
+    {
+        int empty = 1;
+
+        for (int i = 4; i < msg_kept_length(msg)-1; i++)
+        {
+            if (msg[i])
+            {
+                empty = 0;
+            }
+        }
+
+        // Kind, index and codes as received
+        if (!empty)
+        {
+            dash_send_record(DASH_REC_DTC, msg+2, msg_kept_length(msg)-3);
+        }
+
+        if (empty || ++dtc_index > DTC_MAX_INDEX)
+        {
+            if (dtc_kind == DTC_CURRENT)
+            {
+                dtc_kind = DTC_PAST;
+                dtc_index = 1;
+            }
+            else
+            {
+                dtc_finish(1);
+            }
+        }
+    }
+
+    // Poll cycle became due while waiting for the response
+    if (dtc_preempt)
+    {
+        dtc_preempt = 0;
+        return poll_start();
+    }
+
+    return dtc_next();
+}
+
+// ECU identity from the contents of table 0
+static uint32_t ecu_id_hash(const unsigned char *msg)
+{
+    uint32_t hash = 0x811c9dc5;
+
+    for (int i = 4; i < msg_kept_length(msg)-1; i++)
+    {
+        hash ^= msg[i];
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+static int table_find(const uint8_t *tables, int count, uint8_t table)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (tables[i] == table)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Profile tables the ECU has come first, they are the ones the dash decodes.
+// The rest of the map fills the schedule in scan order.
+static void build_poll_schedule(const scan_map_t *map)
+{
+    const ecu_profile_t *profile = ecu_profile();
+
+    poll_count = 0;
+    poll_index = 0;
+    memset(poll_len, 0, sizeof(poll_len));
+
+    for (int i = 0; i < profile->poll_count && poll_count < ECU_MAX_POLL; i++)
+    {
+        if (table_find(map->tables, map->count, profile->poll_tables[i]) >= 0 &&
+            table_find(poll_tables, poll_count, profile->poll_tables[i]) < 0)
+        {
+            poll_tables[poll_count++] = profile->poll_tables[i];
+        }
+    }
+
+    for (int i = 0; i < map->count && poll_count < ECU_MAX_POLL; i++)
+    {
+        // Table 0 is static, no need to poll it
+        if (map->tables[i] != SCAN_ID_TABLE && table_find(poll_tables, poll_count, map->tables[i]) < 0)
+        {
+            poll_tables[poll_count++] = map->tables[i];
+        }
+    }
+
+    // Nothing found or scan is off, use profile tables
+    if (poll_count == 0)
+    {
+        memcpy(poll_tables, profile->poll_tables, profile->poll_count);
+        poll_count = profile->poll_count;
+    }
+}
+
+static int scan_cache_load(uint32_t ecu_id)
+{
+    const scan_cache_t *cache = (const scan_cache_t *) flash_store_read(FLASH_SLOT_SCAN, SCAN_MAGIC);
+
+    // Cache waiting for flash is newer than the stored one
+    if (!scan_save_pending)
+    {
+        if (cache == NULL)
+        {
+            memset(&scan_cache, 0, sizeof(scan_cache));
+            scan_cache.magic = SCAN_MAGIC;
+            return 0;
+        }
+
+        scan_cache = *cache;
+    }
+
+    for (int i = 0; i < SCAN_CACHE_SIZE; i++)
+    {
+        if (scan_cache.maps[i].count > 0 && scan_cache.maps[i].ecu_id == ecu_id)
+        {
+            scan_map = scan_cache.maps[i];
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Flash may be busy with another slot, the housekeeping tick tries again
+static void scan_cache_sync(void)
+{
+    if (scan_save_pending)
+    {
+        scan_save_pending = !flash_store_write(FLASH_SLOT_SCAN, (const uint32_t *) &scan_cache, sizeof(scan_cache) / sizeof(uint32_t));
+    }
+}
+
+static void scan_cache_save(void)
+{
+    int i = scan_cache.next % SCAN_CACHE_SIZE;
+
+    scan_cache.maps[i] = scan_map;
+    scan_cache.next = i + 1;
+    scan_save_pending = 1;
+    scan_cache_sync();
+}
+
+static void scan_start(void)
+{
+    scan_table = SCAN_ID_TABLE;
+    ecu_send_table_req(SCAN_ID_TABLE);
+    deadline_set(DL_TIMEOUT, SCAN_TIMEOUT);
+}
+
+static int scan_done(void)
+{
+    deadline_clear(DL_TIMEOUT);
+    build_poll_schedule(&scan_map);
+    ecu_send_table_req(poll_tables[0]);
+    return MAIN_STM_RUN;
+}
+
+// Called with table response or NULL if probed table did not respond
+static int scan_process(const unsigned char *msg)
+{
+    int len = msg ? msg[1] - 5 : 0;
+
+    if (scan_table == SCAN_ID_TABLE)
+    {
+        uint32_t ecu_id = msg ? ecu_id_hash(msg) : 0;
+
+        if (scan_cache_load(ecu_id))
+        {
+            trace_event(TRACE_SCAN_CACHED, scan_map.count);
+            return scan_done();
+        }
+
+        memset(&scan_map, 0, sizeof(scan_map));
+        scan_map.ecu_id = ecu_id;
+        trace_event(TRACE_SCAN_START, ecu_id);
+
+        // Probing takes up to a minute with next to nothing to send
+        conn_params_streaming(0);
+    }
+
+    if (len > 0 && scan_map.count < ECU_MAX_TABLES)
+    {
+        scan_map.tables[scan_map.count] = scan_table;
+        scan_map.lengths[scan_map.count] = len;
+        scan_map.count++;
+    }
+
+    if (scan_table == 0xff)
+    {
+        scan_cache_save();
+        trace_event(TRACE_SCAN_DONE, scan_map.count);
+        return scan_done();
+    }
+
+    scan_table++;
+    ecu_send_table_req(scan_table);
+    deadline_set(DL_TIMEOUT, SCAN_TIMEOUT);
+    return MAIN_STM_SCAN;
+}
+
+static int ecu_process_msg(unsigned char *msg)
+{
+    uint32_t turnaround;
+    uint32_t total;
+    int state = MAIN_STM_RUN;
+
+    // Own request echoed back from K-line
+    if (msg[0] == 0x72)
+    {
+        echo_time = msg_time;
+    }
+
+    // Ecu response
+    if (msg[0] == 0x02)
+    {
+        // Init OK, find out which tables this ECU has
+        if (msg[2] == ecu_profile()->init_cmd)
+        {
+            if (ecu_profile()->flags & PROFILE_FLAG_SCAN)
+            {
+                scan_start();
+                return MAIN_STM_SCAN;
+            }
+
+            memset(&scan_map, 0, sizeof(scan_map));
+            return scan_done();
+        }
+
+        switch (msg[2])
+        {
+        // Table contents
+        case 0x71:
+            if (poll_index < poll_count && msg[3] == poll_tables[poll_index])
+            {
+                app_timer_cnt_diff_compute(msg_start, echo_time, &turnaround);
+                app_timer_cnt_diff_compute(msg_time, req_time, &total);
+                ecu_stats_latency(poll_index, msg[3], turnaround, total);
+                poll_len[poll_index] = msg[1];
+
+                // Next request goes out first, the ECU works on it while
+                // this sample is encoded and queued upstream
+                poll_index = poll_next(poll_index + 1);
+                if (poll_index >= poll_count)
+                {
+                    state = dtc_next();
+                }
+                else
+                {
+                    ecu_send_table_req(poll_tables[poll_index]);
+                }
+            }
+            dash_send_msg();
+            break;
+
+        // Diagnostic trouble codes
+        case DTC_CURRENT:
+        case DTC_PAST:
+        case DTC_CLEAR:
+            return dtc_process(msg);
+        }
+    }
+
+    return state;
+}
+
+// Profile to dash: index and profile struct as little endian hex
+static void dash_send_profile(void)
+{
+    unsigned char rec[1 + sizeof(ecu_profile_t)];
+
+    rec[0] = ecu_profile_index();
+    memcpy(rec+1, ecu_profile(), sizeof(ecu_profile_t));
+    dash_send_record(DASH_REC_PROFILE, rec, sizeof(rec));
+}
+
+void ecu_dash_cmd(const unsigned char *cmd, int len)
+{
+    if (len < 1)
+    {
+        return;
+    }
+
+    // New profile is used from a fresh init, current one is reported back
+    if (cmd[0] == DASH_CMD_PROFILE || cmd[0] == DASH_CMD_PROFILE_UPLOAD)
+    {
+        int changed = 0;
+
+        if (cmd[0] == DASH_CMD_PROFILE && len == 2)
+        {
+            changed = ecu_profile_select(cmd[1]);
+        }
+        if (cmd[0] == DASH_CMD_PROFILE_UPLOAD)
+        {
+            changed = ecu_profile_upload(cmd+1, len-1);
+        }
+        if (changed && dash_state == DASH_CONNECTED)
+        {
+            deadline_set(DL_SESSION, 0);
+        }
+
+        dash_send_profile();
+        return;
+    }
+
+    if (cmd[0] == DASH_CMD_STATS)
+    {
+        stats_part = 0;
+        deadline_set(DL_STATS, 0);
+        return;
+    }
+
+    if (dtc_op != DTC_OP_NONE)
+    {
+        return;
+    }
+
+    switch (cmd[0])
+    {
+    case DASH_CMD_DTC_READ:
+        dtc_kind = DTC_CURRENT;
+        dtc_index = 1;
+        dtc_retry = 0;
+        dtc_op = DTC_OP_READ;
+        break;
+
+    case DASH_CMD_DTC_CLEAR:
+        dtc_retry = 0;
+        dtc_op = DTC_OP_CLEAR;
+        break;
+    }
+}
+
+// ECU is not answering, session is started over from wakeup and init
+static int main_reinit(void)
+{
+    ecu_stats.reinit++;
+    trace_event(TRACE_REINIT, ecu_stats.reinit);
+    return 0;
+}
+
+int do_main_stm(int reason, unsigned char rx)
+{
+    // State machine init
+    if (reason == MAIN_REASON_INIT)
+    {
+        main_state = MAIN_STM_NONE;
+        main_watchdog = 0;
+        dtc_op = DTC_OP_NONE;
+        dtc_wait = 0;
+        dtc_preempt = 0;
+        req_retry = 0;
+        req_giveup = 0;
+        poll_count = 0;
+        poll_gap = POLL_GAP_START;
+        poll_err = 0;
+        poll_err_seen = poll_errors();
+        return 1;
+    }
+
+    switch (main_state)
+    {
+    case MAIN_STM_NONE:
+        // Empty
+        break;
+
+    case MAIN_STM_SCAN:
+        if (reason == MAIN_REASON_RX || reason == MAIN_REASON_IDLE)
+        {
+            int res = reason == MAIN_REASON_RX ? do_msg_stm(rx) : msg_idle();
+
+            // Own request echo and other frames are ignored
+            if (res == MSG_STATUS_OK && msg_head[0] == 0x02 && msg_head[2] == 0x71 && msg_head[3] == scan_table)
+            {
+                main_state = scan_process(msg_buf);
+            }
+        }
+        else if (reason == MAIN_REASON_TIMEOUT)
+        {
+            main_state = scan_process(NULL);
+        }
+        break;
+
+    case MAIN_STM_RUN:
+        if (reason == MAIN_REASON_RX || reason == MAIN_REASON_IDLE)
+        {
+            int res = reason == MAIN_REASON_RX ? do_msg_stm(rx) : msg_idle();
+
+            if (res == MSG_STATUS_OK)
+            {
+                // ECU answered, retry not needed
+                if (msg_head[0] == 0x02)
+                {
+                    deadline_clear(DL_TIMEOUT);
+                    req_retry = 0;
+                    req_giveup = 0;
+                }
+
+                main_state = ecu_process_msg(msg_frame_head());
+                main_watchdog = 0;
+            }
+
+            if (res == MSG_STATUS_ERR)
+            {
+                trace_event(TRACE_MSG_ERR, main_state);
+
+                // Truncated frame leaves the line already quiet
+                deadline_set(DL_TIMEOUT, reason == MAIN_REASON_IDLE ? 0 : REQ_RETRY_DELAY);
+            }
+        }
+        else if (reason == MAIN_REASON_TIMEOUT)
+        {
+            // Send the failed request again, give up after a few tries
+            poll_err = 1;
+
+            if (req_retry < REQ_MAX_RETRY)
+            {
+                req_retry++;
+                trace_event(TRACE_REQ_RETRY, req_retry);
+                reset_msg_stm();
+                ecu_send_req(req_last);
+            }
+            else
+            {
+                req_retry = 0;
+                req_giveup++;
+                dtc_cancel();
+                main_state = poll_wait();
+            }
+        }
+        else // every ~2.5 seconds
+        {
+            // Live data has priority over DTC transaction
+            if (dtc_wait)
+            {
+                if (dtc_preempt)
+                {
+                    dtc_cancel();
+                    main_state = poll_start();
+                }
+                else
+                {
+                    dtc_preempt = 1;
+                }
+            }
+
+            if (++main_watchdog > MAIN_WATCHDOG_MAX || req_giveup >= MAIN_WATCHDOG_MAX)
+            {
+                return main_reinit();
+            }
+        }
+        break;
+
+    case MAIN_STM_POLL:
+        // after the poll gap
+        if (reason == MAIN_REASON_TIMEOUT)
+        {
+            main_state = poll_start();
+        }
+        // every ~2.5 seconds, no tables means init was never answered
+        else if (reason == MAIN_REASON_NONE && (poll_count == 0 || req_giveup >= MAIN_WATCHDOG_MAX))
+        {
+            return main_reinit();
+        }
+        break;
+    }
+
+    return 1;
+}
+
+// Red led is on once per period, longer when dash is connected
+static void blink_status(void)
+{
+    int on_time = dash_state == DASH_CONNECTED ? LED_ON_CONNECTED : LED_ON_IDLE;
+
+    led_red_on = !led_red_on;
+
+    if (led_red_on)
+    {
+        nrf_gpio_pin_clear(RUUVI_LED_RED);
+        deadline_set(DL_LED_RED, on_time);
+    }
+    else
+    {
+        nrf_gpio_pin_set(RUUVI_LED_RED);
+        deadline_set(DL_LED_RED, LED_PERIOD - on_time);
+    }
+}
+
+static void init_sequence(void)
+{
+    const ecu_profile_t *profile = ecu_profile();
+
+    switch (init_step++)
+    {
+    case 0:
+        break_downstream(1);
+        deadline_set(DL_INIT, profile->wait_pulse);
+        break;
+    case 1:
+        break_downstream(0);
+        deadline_set(DL_INIT, profile->wait_after_pulse);
+        break;
+    case 2:
+        ecu_send_req(REQ_WAKEUP);
+        deadline_set(DL_INIT, profile->wait_after_wakeup);
+        break;
+    case 3:
+        ecu_send_cmd(profile->init_cmd, profile->init_arg);
+        main_state = MAIN_STM_RUN;
+        deadline_set(DL_POLL, profile->interval_poll);
+        break;
+    }
+}
+
+static void session_start(void)
+{
+    trace_event(TRACE_SESSION, 1);
+    do_main_stm(MAIN_REASON_INIT, 0);
+    init_step = 0;
+    deadline_set(DL_INIT, ecu_profile()->wait_before_pulse);
+}
+
+static void session_stop(void)
+{
+    trace_event(TRACE_SESSION, 0);
+    do_main_stm(MAIN_REASON_INIT, 0);
+    break_downstream(0);
+    deadline_clear(DL_INIT);
+    deadline_clear(DL_POLL);
+    deadline_clear(DL_TIMEOUT);
+    deadline_clear(DL_GAP);
+}
+
+static void deadline_dispatch(int id)
+{
+    switch (id)
+    {
+    case DL_SESSION:
+        if (dash_state == DASH_CONNECTED)
+        {
+            session_start();
+        }
+        else
+        {
+            session_stop();
+        }
+        break;
+
+    case DL_INIT:
+        init_sequence();
+        break;
+
+    case DL_POLL:
+        trace_flush();
+        ecu_profile_sync();
+        sys_attr_sync();
+        scan_cache_sync();
+
+        // Restart if main state machine returns 0, ECU has gone quiet
+        if (!do_main_stm(MAIN_REASON_NONE, 0))
+        {
+            conn_params_streaming(0);
+            session_start();
+            break;
+        }
+        deadline_set(DL_POLL, ecu_profile()->interval_poll);
+        break;
+
+    case DL_TIMEOUT:
+        do_main_stm(MAIN_REASON_TIMEOUT, 0);
+        break;
+
+    case DL_STATS:
+        // Stats requested by dash, one record per deadline
+        if (stats_part >= 0)
+        {
+            stats_part = dash_send_stats(stats_part);
+        }
+        if (stats_part >= 0)
+        {
+            deadline_set(DL_STATS, INTERVAL_STATS);
+        }
+        break;
+
+    case DL_LED_RED:
+        blink_status();
+        break;
+
+    case DL_LED_GREEN:
+        nrf_gpio_pin_set(RUUVI_LED_GREEN);
+        break;
+
+    case DL_GAP:
+        do_main_stm(MAIN_REASON_IDLE, 0);
+        break;
+    }
+}
+
+static void deadline_timer_handler(void * p_context)
+{
+    deadline_dispatch((int) p_context);
+}
+
+static void rx_sched_handler(void * p_event_data, uint16_t event_size)
+{
+    rx_pending = 0;
+
+    while (rx_tail != rx_head)
+    {
+        rx_time = rx_times[rx_tail];
+        do_main_stm(MAIN_REASON_RX, rx_bytes[rx_tail]);
+        rx_tail = (rx_tail + 1) % RX_RING_SIZE;
+    }
+
+    // Frame still open, expect the next byte before the line goes idle
+    if (msg_state != MSG_STM_IDLE)
+    {
+        deadline_set(DL_GAP, MSG_IDLE_GAP);
+    }
+}
+
+// Called from UART interrupt, bytes are timestamped here and parsed in main loop
+void ecu_uart_rx(void)
+{
+    unsigned char rx;
+    uint32_t now;
+
+    app_timer_cnt_get(&now);
+
+    while (app_uart_get(&rx) == NRF_SUCCESS)
+    {
+        unsigned int next = (rx_head + 1) % RX_RING_SIZE;
+
+        if (next == rx_tail)
+        {
+            ecu_stats.uart_fifo_err++;
+            continue;
+        }
+
+        rx_bytes[rx_head] = rx;
+        rx_times[rx_head] = now;
+        rx_head = next;
+    }
+
+    // One event drains the whole ring, retried on next byte if queue is full
+    if (!rx_pending)
+    {
+        rx_pending = 1;
+
+        if (app_sched_event_put(NULL, 0, rx_sched_handler) != NRF_SUCCESS)
+        {
+            rx_pending = 0;
+        }
+    }
+}
+
+// Called from BLE event handler, session is started or stopped in timer context
+void ecu_dash_connected(int connected)
+{
+    dash_state = connected ? DASH_CONNECTED : DASH_DISCONNECTED;
+    deadline_set(DL_SESSION, 0);
+}
+
+void ecu_init(void)
+{
+    nrf_gpio_cfg_input(RUUVI_UART_RX, NRF_GPIO_PIN_PULLUP);
+    nrf_gpio_cfg(
+        RUUVI_UART_TX,
+        NRF_GPIO_PIN_DIR_OUTPUT,
+        NRF_GPIO_PIN_INPUT_DISCONNECT,
+        NRF_GPIO_PIN_NOPULL,
+        NRF_GPIO_PIN_H0S1,
+        NRF_GPIO_PIN_NOSENSE);
+
+    nrf_gpio_pin_write(RUUVI_UART_TX, 1);
+
+    nrf_gpio_cfg_output(RUUVI_LED_RED);
+    nrf_gpio_cfg_output(RUUVI_LED_GREEN);
+
+    nrf_gpio_pin_set(RUUVI_LED_RED);
     nrf_gpio_pin_set(RUUVI_LED_GREEN);
 
-    // Start main timer
-    app_simple_timer_init();
-    app_simple_timer_start(APP_SIMPLE_TIMER_MODE_REPEATED, main_timer_handler, TIMER_MS(INTERVAL_MAIN), NULL);
+    upstream_init();
+    rtt_sink_init();
+    msg_frame = frame_alloc();
+    msg_buf = &msg_frame->data[1];
+
+    dl_timers[DL_SESSION] = session_timer;
+    dl_timers[DL_INIT] = init_timer;
+    dl_timers[DL_POLL] = poll_timer;
+    dl_timers[DL_TIMEOUT] = timeout_timer;
+    dl_timers[DL_STATS] = stats_timer;
+    dl_timers[DL_LED_RED] = led_red_timer;
+    dl_timers[DL_LED_GREEN] = led_green_timer;
+    dl_timers[DL_GAP] = gap_timer;
+
+    for (int i = 0; i < DL_COUNT; i++)
+    {
+        uint32_t err_code = app_timer_create(&dl_timers[i], APP_TIMER_MODE_SINGLE_SHOT, deadline_timer_handler);
+        APP_ERROR_CHECK(err_code);
+    }
+
+    // Nothing runs until dash connects, only the status led
+    deadline_set(DL_LED_RED, LED_PERIOD - LED_ON_IDLE);
 }
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 
+#include "ble_nus.h"
+
 #define ECU_BAUDRATE        0x2aa000
 #define BREAK_BAUDRATE      0x007000
 
@@ -23,21 +25,46 @@
 #define MSG_STATUS_ERR      2
 
 #define MAIN_STM_NONE       0
+#define MAIN_STM_SCAN       3
 #define MAIN_STM_RUN        4
-#define MAIN_STM_REQ_11     5
+#define MAIN_STM_POLL       5
 
 #define MAIN_REASON_NONE    0
 #define MAIN_REASON_RX      1
 #define MAIN_REASON_INIT    2
+#define MAIN_REASON_TIMEOUT 3
+#define MAIN_REASON_IDLE    4
 
 #define MAIN_WATCHDOG_MAX   5
 
+#define ECU_MAX_TABLES      16
+#define ECU_MAX_POLL        8
+
+// Commands from dash, first byte of NUS data
+#define DASH_CMD_DTC_READ   'D'
+#define DASH_CMD_DTC_CLEAR  'C'
+#define DASH_CMD_STATS      'S'
+#define DASH_CMD_PROFILE    'P'
+#define DASH_CMD_PROFILE_UPLOAD 'U'
+
+// Record types to dash, sent as '!' + type + hex data
+#define DASH_REC_DTC        'D'
+#define DASH_REC_DTC_CLEAR  'C'
+#define DASH_REC_STATS      'S'
+#define DASH_REC_TURNAROUND 'T'
+#define DASH_REC_TOTAL      'L'
+#define DASH_REC_PROFILE    'P'
+
 // Functions between main.c and ecu_msg.c
 
 extern void ecu_init(void);
 extern int do_main_stm(int reason, unsigned char rx);
+extern void ecu_dash_cmd(const unsigned char *cmd, int len);
+extern void ecu_dash_connected(int connected);
+extern void ecu_uart_rx(void);
 
 extern ble_nus_t *nus_get_service(void);
 extern uint16_t nus_get_conn_handle(void);
+extern void conn_params_streaming(int streaming);
 
 #endif
@@ -0,0 +1,183 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "nrf.h"
+
+#include "ecu_profile.h"
+#include "flash_store.h"
+
+#define PROFILE_MAGIC       0x50524f46
+
+// Flash record, selected index and the uploaded profile
+typedef struct
+{
+    uint32_t magic;
+    uint32_t index;
+    ecu_profile_t custom;
+} profile_record_t;
+
+static const ecu_profile_t PROFILES[PROFILE_COUNT] =
+{
+    // Honda PGM-FI, tables found by scan, 0x11 and 0xd1 as fallback
+    {
+        .layout = 0,
+        .flags = PROFILE_FLAG_SCAN,
+        .init_cmd = 0x00,
+        .init_arg = 0xf0,
+        .baud = 10400,
+        .wait_before_pulse = 10,
+        .wait_pulse = 70,
+        .wait_after_pulse = 130,
+        .wait_after_wakeup = 50,
+        .interval_poll = 2500,
+        .poll_count = 2,
+        .poll_tables = {0x11, 0xd1},
+    },
+    // Honda PGM-FI without scan, polls 0x11 and 0xd1 right after init
+    {
+        .layout = 0,
+        .flags = 0,
+        .init_cmd = 0x00,
+        .init_arg = 0xf0,
+        .baud = 10400,
+        .wait_before_pulse = 10,
+        .wait_pulse = 70,
+        .wait_after_pulse = 130,
+        .wait_after_wakeup = 50,
+        .interval_poll = 2500,
+        .poll_count = 2,
+        .poll_tables = {0x11, 0xd1},
+    },
+};
+
+static profile_record_t record;
+static const ecu_profile_t *profile = &PROFILES[0];
+static int save_pending = 0;
+
+uint32_t ecu_profile_baudrate(void)
+{
+    // UART BAUDRATE register is baud * 2^32 / 16 MHz, low 12 bits unused
+    uint32_t reg = ((uint64_t) profile->baud << 32) / 16000000;
+
+    return (reg + 0x800) & 0xfffff000;
+}
+
+// Custom profiles come from the dash, anything the engine can not run is refused
+static int profile_valid(const ecu_profile_t *p)
+{
+    if (p->baud < PROFILE_BAUD_MIN || p->interval_poll < PROFILE_POLL_MIN || p->poll_count > ECU_MAX_POLL)
+    {
+        return 0;
+    }
+
+    // Without tables there has to be something to scan
+    return p->poll_count > 0 || (p->flags & PROFILE_FLAG_SCAN);
+}
+
+static void profile_apply(void)
+{
+    if (record.index == PROFILE_CUSTOM)
+    {
+        profile = &record.custom;
+    }
+    else
+    {
+        profile = &PROFILES[record.index];
+    }
+
+    NRF_UART0->BAUDRATE = ecu_profile_baudrate();
+}
+
+void ecu_profile_init(void)
+{
+    const profile_record_t *stored = (const profile_record_t *) flash_store_read(FLASH_SLOT_PROFILE, PROFILE_MAGIC);
+
+    if (stored && (stored->index < PROFILE_COUNT || (stored->index == PROFILE_CUSTOM && profile_valid(&stored->custom))))
+    {
+        record = *stored;
+    }
+    else
+    {
+        record.magic = PROFILE_MAGIC;
+        record.index = 0;
+    }
+
+    profile_apply();
+}
+
+const ecu_profile_t *ecu_profile(void)
+{
+    return profile;
+}
+
+int ecu_profile_index(void)
+{
+    return record.index;
+}
+
+// Flash may be busy with another slot, ecu_profile_sync tries again later
+static void profile_save(void)
+{
+    save_pending = !flash_store_write(FLASH_SLOT_PROFILE, (const uint32_t *) &record, sizeof(record) / sizeof(uint32_t));
+}
+
+void ecu_profile_sync(void)
+{
+    if (save_pending)
+    {
+        profile_save();
+    }
+}
+
+int ecu_profile_select(int index)
+{
+    if (index >= PROFILE_COUNT && (index != PROFILE_CUSTOM || !profile_valid(&record.custom)))
+    {
+        return 0;
+    }
+
+    record.index = index;
+    profile_apply();
+    profile_save();
+    return 1;
+}
+
+// layout, flags, init cmd, init arg, baud (2, little endian), four waits, poll interval (2), tables
+int ecu_profile_upload(const uint8_t *data, int len)
+{
+    ecu_profile_t upload;
+    ecu_profile_t *p = &upload;
+    int count = len - PROFILE_UPLOAD_SIZE;
+
+    if (count < 0 || count > ECU_MAX_POLL)
+    {
+        return 0;
+    }
+
+    // Parsed apart, the custom profile may be the one running
+    memset(p, 0, sizeof(*p));
+    p->layout = data[0];
+    p->flags = data[1];
+    p->init_cmd = data[2];
+    p->init_arg = data[3];
+    p->baud = data[4] | (data[5] << 8);
+    p->wait_before_pulse = data[6];
+    p->wait_pulse = data[7];
+    p->wait_after_pulse = data[8];
+    p->wait_after_wakeup = data[9];
+    p->interval_poll = data[10] | (data[11] << 8);
+    p->poll_count = count;
+    memcpy(p->poll_tables, &data[PROFILE_UPLOAD_SIZE], count);
+
+    if (!profile_valid(p))
+    {
+        return 0;
+    }
+
+    record.custom = upload;
+    record.index = PROFILE_CUSTOM;
+    profile_apply();
+    profile_save();
+    return 1;
+}
@@ -0,0 +1,56 @@
+#ifndef ECU_PROFILE_H
+#define ECU_PROFILE_H
+
+#include <stdint.h>
+
+#include "ecu_msg.h"
+
+// Selected with dash command 'P' + index, PROFILE_CUSTOM is the one uploaded with 'U'
+#define PROFILE_COUNT       2
+#define PROFILE_CUSTOM      0x80
+
+// Scan tables after init, otherwise poll the profile tables directly
+#define PROFILE_FLAG_SCAN   0x01
+
+// Upload is 'U' + fixed part + poll tables, must fit in one NUS write
+#define PROFILE_UPLOAD_SIZE 12
+
+// Lowest K-line baudrate, a byte must pass well within the inside-frame idle gap
+#define PROFILE_BAUD_MIN    1200
+
+// Shortest housekeeping tick in ms, one request and all its retries fit in between
+#define PROFILE_POLL_MIN    1000
+
+typedef struct
+{
+    uint8_t layout;                     // table layout id for dash decoding
+    uint8_t flags;
+    uint8_t init_cmd;                   // init request 72 05 <cmd> <arg>
+    uint8_t init_arg;
+    uint16_t baud;                      // K-line bits per second
+    uint8_t wait_before_pulse;          // ms
+    uint8_t wait_pulse;                 // ms
+    uint8_t wait_after_pulse;           // ms
+    uint8_t wait_after_wakeup;          // ms
+    uint16_t interval_poll;             // ms between housekeeping ticks, longest gap between poll cycles
+    uint8_t poll_count;
+    uint8_t poll_tables[ECU_MAX_POLL];  // polled if scan is off or finds nothing
+} ecu_profile_t;
+
+// Functions between main.c, ecu_msg.c and ecu_profile.c
+
+// Loads selection from flash and sets UART baudrate, flash_store must be initialized
+extern void ecu_profile_init(void);
+
+extern const ecu_profile_t *ecu_profile(void);
+extern int ecu_profile_index(void);
+extern uint32_t ecu_profile_baudrate(void);
+
+// Return 1 if profile was changed and applied, flash save may still be pending
+extern int ecu_profile_select(int index);
+extern int ecu_profile_upload(const uint8_t *data, int len);
+
+// Retries a flash save that found flash busy
+extern void ecu_profile_sync(void);
+
+#endif
@@ -0,0 +1,130 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "app_timer.h"
+#include "nrf.h"
+
+#include "ecu_stats.h"
+
+ecu_stats_t ecu_stats;
+
+// Stack bounds from linker script
+extern uint32_t __StackLimit;
+extern uint32_t __StackTop;
+
+static uint32_t window_start = 0;
+static uint32_t window_samples = 0;
+
+static uint32_t ticks_to_ms(uint32_t ticks)
+{
+    // RTC1 runs at 32768 Hz, 24-bit counter
+    return (ticks * 125) / 4096;
+}
+
+void ecu_stats_sample(uint32_t time)
+{
+    uint32_t elapsed;
+
+    ecu_stats.samples++;
+    window_samples++;
+
+    app_timer_cnt_diff_compute(time, window_start, &elapsed);
+
+    if (elapsed >= STATS_RATE_WINDOW)
+    {
+        ecu_stats.sample_rate = (window_samples * 100000) / ticks_to_ms(elapsed);
+        window_start = time;
+        window_samples = 0;
+    }
+}
+
+static int hist_bucket(uint32_t ticks)
+{
+    uint32_t ms = ticks_to_ms(ticks);
+    int bucket = 0;
+
+    while (ms && bucket < STATS_HIST_BUCKETS-1)
+    {
+        ms >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+static void hist_add(uint16_t *hist, uint32_t ticks)
+{
+    int bucket = hist_bucket(ticks);
+
+    if (hist[bucket] < 0xffff)
+    {
+        hist[bucket]++;
+    }
+}
+
+void ecu_stats_latency(int slot, uint8_t table, uint32_t turnaround, uint32_t total)
+{
+    ecu_latency_t *lat = &ecu_stats.latency;
+
+    if (slot >= STATS_MAX_TABLES)
+    {
+        return;
+    }
+
+    // Schedule changed, start over for this slot
+    if (lat->table[slot] != table)
+    {
+        memset(lat->turnaround[slot], 0, sizeof(lat->turnaround[slot]));
+        memset(lat->total[slot], 0, sizeof(lat->total[slot]));
+        lat->table[slot] = table;
+    }
+
+    hist_add(lat->turnaround[slot], turnaround);
+    hist_add(lat->total[slot], total);
+}
+
+// Fill unused stack with pattern, called first thing in main
+void ecu_stats_stack_paint(void)
+{
+    uint32_t *ptr = &__StackLimit;
+    uint32_t *sp = (uint32_t *) __get_MSP();
+
+    // Leave the frames below the current one alone
+    while (ptr < sp - 16)
+    {
+        *ptr++ = STATS_STACK_PAINT;
+    }
+
+    ecu_stats.stack_size = (uint32_t) &__StackTop - (uint32_t) &__StackLimit;
+}
+
+// Deepest stack use since boot, first overwritten word from the bottom
+static uint32_t stack_high_water(void)
+{
+    uint32_t *ptr = &__StackLimit;
+
+    while (ptr < &__StackTop && *ptr == STATS_STACK_PAINT)
+    {
+        ptr++;
+    }
+
+    return (uint32_t) &__StackTop - (uint32_t) ptr;
+}
+
+// Refresh derived values before stats are read
+void ecu_stats_update(void)
+{
+    uint32_t now;
+    uint32_t elapsed;
+
+    ecu_stats.stack_used = stack_high_water();
+
+    // No samples for two windows, data stream has stopped
+    app_timer_cnt_get(&now);
+    app_timer_cnt_diff_compute(now, window_start, &elapsed);
+
+    if (elapsed >= 2 * STATS_RATE_WINDOW)
+    {
+        ecu_stats.sample_rate = 0;
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef ECU_STATS_H
+#define ECU_STATS_H
+
+#include <stdint.h>
+
+// Sample rate is averaged over this many RTC1 ticks
+#define STATS_RATE_WINDOW   (5 * 32768)
+
+// Unused stack words hold this pattern
+#define STATS_STACK_PAINT   0x5354434b
+
+// Latency histograms per polled table, bucket n counts times of 2^(n-1) .. 2^n-1 ms
+#define STATS_MAX_TABLES    8
+#define STATS_HIST_BUCKETS  12
+
+typedef struct
+{
+    uint8_t table[STATS_MAX_TABLES];                            // 0 when slot is unused
+    uint16_t turnaround[STATS_MAX_TABLES][STATS_HIST_BUCKETS];  // end of request to first response byte
+    uint16_t total[STATS_MAX_TABLES][STATS_HIST_BUCKETS];       // request sent to response validated
+} ecu_latency_t;
+
+// Runtime counters, sent as little endian struct
+typedef struct
+{
+    uint32_t csum_err;          // frames with bad checksum
+    uint32_t length_err;        // frames with bad length byte
+    uint32_t reinit;            // watchdog reinits
+    uint32_t notify_drop;       // failed notifications
+    uint32_t uart_comm_err;     // APP_UART_COMMUNICATION_ERROR
+    uint32_t uart_fifo_err;     // APP_UART_FIFO_ERROR
+    uint32_t samples;           // table samples sent to dash
+    uint32_t sample_rate;       // samples per 100 seconds
+    uint32_t stack_used;        // stack high-water mark in bytes
+    uint32_t stack_size;        // stack size in bytes
+    uint32_t frame_gap;         // frames cut short by K-line idle gap
+    uint32_t poll_skip;         // table requests skipped during BLE congestion
+    ecu_latency_t latency;
+} ecu_stats_t;
+
+// Counters are incremented directly from the hot paths
+extern ecu_stats_t ecu_stats;
+
+extern void ecu_stats_sample(uint32_t time);
+extern void ecu_stats_latency(int slot, uint8_t table, uint32_t turnaround, uint32_t total);
+extern void ecu_stats_update(void);
+extern void ecu_stats_stack_paint(void);
+
+#endif
@@ -0,0 +1,78 @@
+#include <stdint.h>
+
+#include "fstorage.h"
+
+#include "flash_store.h"
+
+static void fs_evt_handler(fs_evt_t const * const evt, fs_ret_t result);
+
+FS_REGISTER_CFG(fs_config_t fs_config) =
+{
+    .callback  = fs_evt_handler,
+    .num_pages = FLASH_SLOT_COUNT,
+    .priority  = 0xfe
+};
+
+static int fs_busy = 0;
+
+static void fs_evt_handler(fs_evt_t const * const evt, fs_ret_t result)
+{
+    // Erase and store are queued back to back, store completes the write
+    if (evt->id == FS_EVT_STORE || result != FS_SUCCESS)
+    {
+        fs_busy = 0;
+    }
+}
+
+static uint32_t *slot_addr(int slot)
+{
+    return fs_config.p_start_addr + slot * FS_PAGE_SIZE_WORDS;
+}
+
+void flash_store_init(void)
+{
+    fs_init();
+}
+
+void flash_store_sys_evt(uint32_t sys_evt)
+{
+    fs_sys_event_handler(sys_evt);
+}
+
+const uint32_t *flash_store_read(int slot, uint32_t magic)
+{
+    const uint32_t *ptr = slot_addr(slot);
+
+    if (slot >= FLASH_SLOT_COUNT || ptr[0] != magic)
+    {
+        return NULL;
+    }
+
+    return ptr;
+}
+
+int flash_store_write(int slot, const uint32_t *data, int words)
+{
+    uint32_t *ptr = slot_addr(slot);
+
+    if (fs_busy || slot >= FLASH_SLOT_COUNT || words > FS_PAGE_SIZE_WORDS)
+    {
+        return 0;
+    }
+
+    fs_busy = 1;
+
+    if (fs_erase(&fs_config, ptr, 1, NULL) != FS_SUCCESS ||
+        fs_store(&fs_config, ptr, data, words, NULL) != FS_SUCCESS)
+    {
+        fs_busy = 0;
+        return 0;
+    }
+
+    return 1;
+}
+
+int flash_store_busy(void)
+{
+    return fs_busy;
+}
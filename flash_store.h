@@ -0,0 +1,26 @@
+#ifndef FLASH_STORE_H
+#define FLASH_STORE_H
+
+#include <stdint.h>
+
+// One flash page per slot, each slot holds a single record
+#define FLASH_SLOT_SCAN     0
+#define FLASH_SLOT_PROFILE  1
+#define FLASH_SLOT_SYS_ATTR 2
+#define FLASH_SLOT_COUNT    3
+
+// Functions between main.c, ecu_msg.c and flash_store.c
+
+extern void flash_store_init(void);
+extern void flash_store_sys_evt(uint32_t sys_evt);
+
+// Returns pointer to the record in flash or NULL if the slot is empty
+extern const uint32_t *flash_store_read(int slot, uint32_t magic);
+
+// Replaces the record in slot. Data must stay valid until the write completes.
+extern int flash_store_write(int slot, const uint32_t *data, int words);
+
+// Returns 1 while a write is in progress
+extern int flash_store_busy(void);
+
+#endif
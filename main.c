@@ -30,15 +30,21 @@
 #include "ble_advertising.h"
 #include "ble_conn_params.h"
 #include "softdevice_handler.h"
+#include "softdevice_handler_appsh.h"
 #include "app_timer.h"
-#include "app_button.h"
+#include "app_timer_appsh.h"
+#include "app_scheduler.h"
 #include "ble_nus.h"
 #include "app_uart.h"
 #include "app_util_platform.h"
-#include "bsp.h"
-#include "bsp_btn_ble.h"
 
 #include "ecu_msg.h"
+#include "ecu_profile.h"
+#include "ecu_stats.h"
+#include "flash_store.h"
+#include "sys_attr.h"
+#include "trace.h"
+#include "upstream.h"
 
 #define IS_SRVC_CHANGED_CHARACT_PRESENT 0                                           /**< Include the service_changed characteristic. If not enabled, the server's database cannot be changed for the lifetime of the device. */
 
@@ -50,31 +56,45 @@
 
 #define CENTRAL_LINK_COUNT              0                                           /**< Number of central links used by the application. When changing this number remember to adjust the RAM settings*/
 #define PERIPHERAL_LINK_COUNT           1                                           /**< Number of peripheral links used by the application. When changing this number remember to adjust the RAM settings*/
+#define PERIPHERAL_CONN_BW_TX           BLE_CONN_BW_HIGH                            /**< TX bandwidth of the peripheral link, high gives the most notifications per connection event. */
+#define PERIPHERAL_CONN_BW_RX           BLE_CONN_BW_MID                             /**< RX bandwidth of the peripheral link, the dash only writes short commands. */
 
 #define DEVICE_NAME                     "ECU"                                       /**< Name of device. Will be included in the advertising data. */
 #define NUS_SERVICE_UUID_TYPE           BLE_UUID_TYPE_VENDOR_BEGIN                  /**< UUID type for the Nordic UART Service (vendor specific). */
+#define BLE_UUID_STATS_CHARACTERISTIC   0x0004                                      /**< UUID of the stats characteristic, uses the Nordic UART Service base UUID. */
 
 #define APP_ADV_INTERVAL                64                                          /**< The advertising interval (in units of 0.625 ms. This value corresponds to 40 ms). */
 #define APP_ADV_TIMEOUT_IN_SECONDS      180                                         /**< The advertising timeout (in units of seconds). */
 
 #define APP_TIMER_PRESCALER             0                                           /**< Value of the RTC1 PRESCALER register. */
-#define APP_TIMER_OP_QUEUE_SIZE         4                                           /**< Size of timer operation queues. */
+#define APP_TIMER_OP_QUEUE_SIZE         12                                          /**< Size of timer operation queues, ECU deadlines queue a stop and a start each. */
+
+#define SCHED_MAX_EVENT_DATA_SIZE       MAX(APP_TIMER_SCHED_EVT_SIZE, BLE_STACK_HANDLER_SCHED_EVT_SIZE) /**< Maximum size of scheduler events. */
+#define SCHED_QUEUE_SIZE                16                                          /**< Maximum number of events in the scheduler queue. */
 
 #define MIN_CONN_INTERVAL               MSEC_TO_UNITS(20, UNIT_1_25_MS)             /**< Minimum acceptable connection interval (20 ms), Connection interval uses 1.25 ms units. */
 #define MAX_CONN_INTERVAL               MSEC_TO_UNITS(75, UNIT_1_25_MS)             /**< Maximum acceptable connection interval (75 ms), Connection interval uses 1.25 ms units. */
 #define SLAVE_LATENCY                   0                                           /**< Slave latency. */
 #define CONN_SUP_TIMEOUT                MSEC_TO_UNITS(4000, UNIT_10_MS)             /**< Connection supervisory timeout (4 seconds), Supervision Timeout uses 10 ms units. */
+#define FAST_MIN_CONN_INTERVAL          MSEC_TO_UNITS(15, UNIT_1_25_MS)             /**< Minimum connection interval while samples are streamed (15 ms). */
+#define FAST_MAX_CONN_INTERVAL          MSEC_TO_UNITS(30, UNIT_1_25_MS)             /**< Maximum connection interval while samples are streamed (30 ms). */
+#define IDLE_MIN_CONN_INTERVAL          MSEC_TO_UNITS(100, UNIT_1_25_MS)            /**< Minimum connection interval while the ECU is idle or polled slowly (100 ms). */
+#define IDLE_MAX_CONN_INTERVAL          MSEC_TO_UNITS(200, UNIT_1_25_MS)            /**< Maximum connection interval while the ECU is idle or polled slowly (200 ms). */
+#define IDLE_SLAVE_LATENCY              4                                           /**< Slave latency while idle, the link stays within the supervision timeout. */
 #define FIRST_CONN_PARAMS_UPDATE_DELAY  APP_TIMER_TICKS(5000, APP_TIMER_PRESCALER)  /**< Time from initiating event (connect or start of notification) to first time sd_ble_gap_conn_param_update is called (5 seconds). */
 #define NEXT_CONN_PARAMS_UPDATE_DELAY   APP_TIMER_TICKS(30000, APP_TIMER_PRESCALER) /**< Time between each call to sd_ble_gap_conn_param_update after the first call (30 seconds). */
 #define MAX_CONN_PARAMS_UPDATE_COUNT    3                                           /**< Number of attempts before giving up the connection parameter negotiation. */
 
 #define DEAD_BEEF                       0xDEADBEEF                                  /**< Value used as error code on stack dump, can be used to identify stack location on stack unwind. */
 
-#define UART_TX_BUF_SIZE                256                                         /**< UART TX buffer size. */
-#define UART_RX_BUF_SIZE                256                                         /**< UART RX buffer size. */
+#define UART_TX_BUF_SIZE                16                                          /**< UART TX buffer size, longest ECU request is 5 bytes. */
+#define UART_RX_BUF_SIZE                16                                          /**< UART RX buffer size, interrupt moves bytes to ECU ring. */
 
 static ble_nus_t                        m_nus;                                      /**< Structure to identify the Nordic UART Service. */
 static uint16_t                         m_conn_handle = BLE_CONN_HANDLE_INVALID;    /**< Handle of the current connection. */
+static int                              m_conn_streaming = -1;                      /**< Requested connection parameter set, -1 until the ECU engine picks one. */
+static uint32_t                         m_ram_start_needed = 0;                     /**< RAM start the SoftDevice asked for high bandwidth, 0 if it was enabled. */
+static ble_gatts_char_handles_t         m_stats_handles;                            /**< Handles of the stats characteristic. */
 
 static ble_uuid_t                       m_adv_uuids[] = {{BLE_UUID_NUS_SERVICE, NUS_SERVICE_UUID_TYPE}};  /**< Universally unique service identifier. */
 
@@ -128,8 +148,8 @@ static void gap_params_init(void)
 
 /**@brief Function for handling the data from the Nordic UART Service.
  *
- * @details This function will process the data received from the Nordic UART BLE Service and send
- *          it to the UART module.
+ * @details This function will pass the data received from the Nordic UART BLE Service to the
+ *          ECU module as dash commands.
  *
  * @param[in] p_nus    Nordic UART Service structure.
  * @param[in] p_data   Data to be send to UART module.
@@ -138,6 +158,7 @@ static void gap_params_init(void)
 /**@snippet [Handling the data received over BLE] */
 static void nus_data_handler(ble_nus_t * p_nus, uint8_t * p_data, uint16_t length)
 {
+    ecu_dash_cmd(p_data, length);
 #if 0
     for (uint32_t i = 0; i < length; i++)
     {
@@ -150,6 +171,82 @@ static void nus_data_handler(ble_nus_t * p_nus, uint8_t * p_data, uint16_t lengt
 /**@snippet [Handling the data received over BLE] */
 
 
+/**@brief Function for adding the stats characteristic to the Nordic UART Service.
+ *
+ * @details The characteristic is read only. Its value is filled with the current stats in
+ *          read authorization, see @ref on_stats_read.
+ */
+static uint32_t stats_char_add(void)
+{
+    ble_gatts_char_md_t char_md;
+    ble_gatts_attr_md_t attr_md;
+    ble_gatts_attr_t    attr_char_value;
+    ble_uuid_t          ble_uuid;
+
+    memset(&char_md, 0, sizeof(char_md));
+
+    char_md.char_props.read = 1;
+
+    ble_uuid.type = m_nus.uuid_type;
+    ble_uuid.uuid = BLE_UUID_STATS_CHARACTERISTIC;
+
+    memset(&attr_md, 0, sizeof(attr_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.write_perm);
+
+    attr_md.vloc    = BLE_GATTS_VLOC_STACK;
+    attr_md.rd_auth = 1;
+    attr_md.wr_auth = 0;
+    attr_md.vlen    = 0;
+
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+
+    attr_char_value.p_uuid    = &ble_uuid;
+    attr_char_value.p_attr_md = &attr_md;
+    attr_char_value.init_len  = sizeof(ecu_stats_t);
+    attr_char_value.init_offs = 0;
+    attr_char_value.max_len   = sizeof(ecu_stats_t);
+
+    return sd_ble_gatts_characteristic_add(m_nus.service_handle,
+                                           &char_md,
+                                           &attr_char_value,
+                                           &m_stats_handles);
+}
+
+
+/**@brief Function for replying to a read of the stats characteristic.
+ *
+ * @details Stats are copied to the attribute when a read starts at offset 0. Long read
+ *          continues from the stored value so the client gets a consistent snapshot.
+ *
+ * @param[in] conn_handle  Connection handle.
+ * @param[in] offset       Offset of the read request.
+ */
+static void on_stats_read(uint16_t conn_handle, uint16_t offset)
+{
+    uint32_t                              err_code;
+    ble_gatts_rw_authorize_reply_params_t auth_reply;
+
+    memset(&auth_reply, 0, sizeof(auth_reply));
+
+    auth_reply.type                    = BLE_GATTS_AUTHORIZE_TYPE_READ;
+    auth_reply.params.read.gatt_status = BLE_GATT_STATUS_SUCCESS;
+
+    // SoftDevice copies the value within the call, no snapshot buffer needed
+    if (offset == 0)
+    {
+        ecu_stats_update();
+        auth_reply.params.read.update = 1;
+        auth_reply.params.read.len    = sizeof(ecu_stats);
+        auth_reply.params.read.p_data = (const uint8_t *) &ecu_stats;
+    }
+
+    err_code = sd_ble_gatts_rw_authorize_reply(conn_handle, &auth_reply);
+    APP_ERROR_CHECK(err_code);
+}
+
+
 /**@brief Function for initializing services that will be used by the application.
  */
 static void services_init(void)
@@ -163,6 +260,9 @@ static void services_init(void)
 
     err_code = ble_nus_init(&m_nus, &nus_init);
     APP_ERROR_CHECK(err_code);
+
+    err_code = stats_char_add();
+    APP_ERROR_CHECK(err_code);
 }
 
 
@@ -181,7 +281,8 @@ static void on_conn_params_evt(ble_conn_params_evt_t * p_evt)
 {
     uint32_t err_code;
 
-    if (p_evt->evt_type == BLE_CONN_PARAMS_EVT_FAILED)
+    // Central refused a streaming or idle set, keep the parameters it chose
+    if (p_evt->evt_type == BLE_CONN_PARAMS_EVT_FAILED && m_conn_streaming < 0)
     {
         err_code = sd_ble_gap_disconnect(m_conn_handle, BLE_HCI_CONN_INTERVAL_UNACCEPTABLE);
         APP_ERROR_CHECK(err_code);
@@ -222,18 +323,75 @@ static void conn_params_init(void)
 }
 
 
+/**@brief Function for requesting a connection parameter set.
+ *
+ * @details Updates the preferred parameters of the Connection Parameters module, which
+ *          negotiates them with the central when connected.
+ *
+ * @param[in] streaming  1 for the streaming set, 0 for the idle set, -1 for the default set.
+ *
+ * @return NRF_SUCCESS or the error from the Connection Parameters module.
+ */
+static uint32_t conn_params_request(int streaming)
+{
+    ble_gap_conn_params_t params;
+
+    memset(&params, 0, sizeof(params));
+
+    if (streaming > 0)
+    {
+        params.min_conn_interval = FAST_MIN_CONN_INTERVAL;
+        params.max_conn_interval = FAST_MAX_CONN_INTERVAL;
+        params.slave_latency     = SLAVE_LATENCY;
+    }
+    else if (streaming == 0)
+    {
+        params.min_conn_interval = IDLE_MIN_CONN_INTERVAL;
+        params.max_conn_interval = IDLE_MAX_CONN_INTERVAL;
+        params.slave_latency     = IDLE_SLAVE_LATENCY;
+    }
+    else
+    {
+        params.min_conn_interval = MIN_CONN_INTERVAL;
+        params.max_conn_interval = MAX_CONN_INTERVAL;
+        params.slave_latency     = SLAVE_LATENCY;
+    }
+    params.conn_sup_timeout = CONN_SUP_TIMEOUT;
+
+    return ble_conn_params_change_conn_params(&params);
+}
+
+
+/**@brief Function for matching the connection parameters to the data rate.
+ *
+ * @details Called by the ECU engine. A short interval is requested while samples are streamed
+ *          and a long interval with slave latency while the ECU is idle or polled slowly.
+ *          Only a change of set starts a new negotiation.
+ *
+ * @param[in] streaming  1 for the streaming set, 0 for the idle set.
+ */
+void conn_params_streaming(int streaming)
+{
+    if (m_conn_handle == BLE_CONN_HANDLE_INVALID || streaming == m_conn_streaming)
+    {
+        return;
+    }
+
+    // Busy with a previous request, try again on the next call
+    if (conn_params_request(streaming) == NRF_SUCCESS)
+    {
+        m_conn_streaming = streaming;
+    }
+}
+
+
 /**@brief Function for putting the chip into sleep mode.
  *
  * @note This function will not return.
  */
 static void sleep_mode_enter(void)
 {
-    uint32_t err_code = bsp_indication_set(BSP_INDICATE_IDLE);
-    APP_ERROR_CHECK(err_code);
-
-    // Prepare wakeup buttons.
-    err_code = bsp_btn_ble_sleep_mode_prepare();
-    APP_ERROR_CHECK(err_code);
+    uint32_t err_code;
 
     // Go to system-off mode (this function will not return; wakeup will cause a reset).
     err_code = sd_power_system_off();
@@ -249,14 +407,8 @@ static void sleep_mode_enter(void)
  */
 static void on_adv_evt(ble_adv_evt_t ble_adv_evt)
 {
-    uint32_t err_code;
-
     switch (ble_adv_evt)
     {
-        case BLE_ADV_EVT_FAST:
-            err_code = bsp_indication_set(BSP_INDICATE_ADVERTISING);
-            APP_ERROR_CHECK(err_code);
-            break;
         case BLE_ADV_EVT_IDLE:
             sleep_mode_enter();
             break;
@@ -266,6 +418,26 @@ static void on_adv_evt(ble_adv_evt_t ble_adv_evt)
 }
 
 
+/**@brief Function for syncing the Nordic UART Service with a restored CCCD.
+ *
+ * @details The service only tracks CCCD writes, stored system attributes enable
+ *          notifications without one.
+ */
+static void nus_notification_restore(void)
+{
+    uint8_t           cccd[BLE_CCCD_VALUE_LEN];
+    ble_gatts_value_t gatts_value;
+
+    memset(&gatts_value, 0, sizeof(gatts_value));
+    gatts_value.len     = sizeof(cccd);
+    gatts_value.p_value = cccd;
+
+    m_nus.is_notification_enabled =
+        sd_ble_gatts_value_get(m_conn_handle, m_nus.rx_handles.cccd_handle, &gatts_value) == NRF_SUCCESS &&
+        ble_srv_is_notification_enabled(cccd);
+}
+
+
 /**@brief Function for the application's SoftDevice event handler.
  *
  * @param[in] p_ble_evt SoftDevice event.
@@ -277,26 +449,60 @@ static void on_ble_evt(ble_evt_t * p_ble_evt)
     switch (p_ble_evt->header.evt_id)
     {
         case BLE_GAP_EVT_CONNECTED:
-            err_code = bsp_indication_set(BSP_INDICATE_CONNECTED);
-            APP_ERROR_CHECK(err_code);
             m_conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+            // Known central gets its CCCDs back, notifications flow before it writes them again
+            (void) sys_attr_restore(m_conn_handle, &p_ble_evt->evt.gap_evt.params.connected.peer_addr);
+            nus_notification_restore();
+            upstream_connected(m_conn_handle);
+            if (m_ram_start_needed != 0)
+            {
+                trace_event(TRACE_RAM_START, m_ram_start_needed);
+            }
+            ecu_dash_connected(1);
             break; // BLE_GAP_EVT_CONNECTED
 
         case BLE_GAP_EVT_DISCONNECTED:
-            err_code = bsp_indication_set(BSP_INDICATE_IDLE);
-            APP_ERROR_CHECK(err_code);
+            sys_attr_save(p_ble_evt->evt.gap_evt.conn_handle);
             m_conn_handle = BLE_CONN_HANDLE_INVALID;
+            // Next central starts from the default set, there is no link to update
+            if (m_conn_streaming >= 0)
+            {
+                (void) conn_params_request(-1);
+                m_conn_streaming = -1;
+            }
+            ecu_dash_connected(0);
+            upstream_flush();
             break; // BLE_GAP_EVT_DISCONNECTED
 
+        case BLE_EVT_TX_COMPLETE:
+            upstream_tx_complete(p_ble_evt->evt.common_evt.params.tx_complete.count);
+            break; // BLE_EVT_TX_COMPLETE
+
         case BLE_GAP_EVT_SEC_PARAMS_REQUEST:
-            // Pairing not supported
-            err_code = sd_ble_gap_sec_params_reply(m_conn_handle, BLE_GAP_SEC_STATUS_PAIRING_NOT_SUPP, NULL, NULL);
-            APP_ERROR_CHECK(err_code);
+            // Just Works bonding, keys are kept with the stored attributes
+            sys_attr_sec_params_reply(m_conn_handle);
             break; // BLE_GAP_EVT_SEC_PARAMS_REQUEST
 
+        case BLE_GAP_EVT_AUTH_STATUS:
+            sys_attr_auth_status(m_conn_handle, &p_ble_evt->evt.gap_evt.params.auth_status);
+            break; // BLE_GAP_EVT_AUTH_STATUS
+
+        case BLE_GAP_EVT_SEC_INFO_REQUEST:
+            // Bonded central encrypts with the stored LTK
+            sys_attr_sec_info_reply(m_conn_handle, &p_ble_evt->evt.gap_evt.params.sec_info_request);
+            break; // BLE_GAP_EVT_SEC_INFO_REQUEST
+
+        case BLE_GATTS_EVT_WRITE:
+            // Dash changed a CCCD, keep it for the next connection
+            if (p_ble_evt->evt.gatts_evt.params.write.handle == m_nus.rx_handles.cccd_handle)
+            {
+                sys_attr_save(m_conn_handle);
+            }
+            break; // BLE_GATTS_EVT_WRITE
+
         case BLE_GATTS_EVT_SYS_ATTR_MISSING:
-            // No system attributes have been stored.
-            err_code = sd_ble_gatts_sys_attr_set(m_conn_handle, NULL, 0, 0);
+            // Attributes are set on connect, user ones may be restored already
+            err_code = sd_ble_gatts_sys_attr_set(m_conn_handle, NULL, 0, BLE_GATTS_SYS_ATTR_FLAG_SYS_SRVCS);
             APP_ERROR_CHECK(err_code);
             break; // BLE_GATTS_EVT_SYS_ATTR_MISSING
 
@@ -326,7 +532,12 @@ static void on_ble_evt(ble_evt_t * p_ble_evt)
 
             req = p_ble_evt->evt.gatts_evt.params.authorize_request;
 
-            if (req.type != BLE_GATTS_AUTHORIZE_TYPE_INVALID)
+            if ((req.type == BLE_GATTS_AUTHORIZE_TYPE_READ) &&
+                (req.request.read.handle == m_stats_handles.value_handle))
+            {
+                on_stats_read(p_ble_evt->evt.gatts_evt.conn_handle, req.request.read.offset);
+            }
+            else if (req.type != BLE_GATTS_AUTHORIZE_TYPE_INVALID)
             {
                 if ((req.request.write.op == BLE_GATTS_OP_PREP_WRITE_REQ)     ||
                     (req.request.write.op == BLE_GATTS_OP_EXEC_WRITE_REQ_NOW) ||
@@ -377,11 +588,23 @@ static void ble_evt_dispatch(ble_evt_t * p_ble_evt)
     ble_nus_on_ble_evt(&m_nus, p_ble_evt);
     on_ble_evt(p_ble_evt);
     ble_advertising_on_ble_evt(p_ble_evt);
-    bsp_btn_ble_on_ble_evt(p_ble_evt);
 
 }
 
 
+/**@brief Function for dispatching a system event to interested modules.
+ *
+ * @details This function is called from the System event interrupt handler after a system
+ *          event has been received.
+ *
+ * @param[in] sys_evt  System stack event.
+ */
+static void sys_evt_dispatch(uint32_t sys_evt)
+{
+    flash_store_sys_evt(sys_evt);
+}
+
+
 /**@brief Function for the SoftDevice initialization.
  *
  * @details This function initializes the SoftDevice and the BLE event interrupt.
@@ -393,7 +616,7 @@ static void ble_stack_init(void)
     nrf_clock_lf_cfg_t clock_lf_cfg = NRF_CLOCK_LFCLKSRC;
 
     // Initialize SoftDevice.
-    SOFTDEVICE_HANDLER_INIT(&clock_lf_cfg, NULL);
+    SOFTDEVICE_HANDLER_APPSH_INIT(&clock_lf_cfg, true);
 
     ble_enable_params_t ble_enable_params;
     err_code = softdevice_enable_get_default_config(CENTRAL_LINK_COUNT,
@@ -404,54 +627,51 @@ static void ble_stack_init(void)
     //Check the ram settings against the used number of links
     CHECK_RAM_START_ADDR(CENTRAL_LINK_COUNT,PERIPHERAL_LINK_COUNT);
 
+    // Buffers for the high bandwidth peripheral link, default config sizes every link for mid bandwidth
+    ble_conn_bw_counts_t conn_bw_counts;
+    memset(&conn_bw_counts, 0, sizeof(conn_bw_counts));
+    conn_bw_counts.tx_counts.high_count = PERIPHERAL_LINK_COUNT;
+    conn_bw_counts.rx_counts.mid_count  = PERIPHERAL_LINK_COUNT;
+    ble_enable_params.common_enable_params.p_conn_bw_counts = &conn_bw_counts;
+
     // Enable BLE stack.
 #if (NRF_SD_BLE_API_VERSION == 3)
     ble_enable_params.gatt_enable_params.att_mtu = NRF_BLE_MAX_MTU_SIZE;
 #endif
     err_code = softdevice_enable(&ble_enable_params);
+    if (err_code == NRF_ERROR_NO_MEM)
+    {
+        // RAM start in the linker script is too low for the extra buffers. The SoftDevice
+        // returns the start it needs, reported on each connection, run with the defaults.
+        extern uint32_t __data_start__;
+
+        m_ram_start_needed = (uint32_t) &__data_start__;
+        (void) sd_ble_enable(&ble_enable_params, &m_ram_start_needed);
+        ble_enable_params.common_enable_params.p_conn_bw_counts = NULL;
+        err_code = softdevice_enable(&ble_enable_params);
+    }
     APP_ERROR_CHECK(err_code);
 
-    // Subscribe for BLE events.
-    err_code = softdevice_ble_evt_handler_set(ble_evt_dispatch);
-    APP_ERROR_CHECK(err_code);
-}
-
-
-/**@brief Function for handling events from the BSP module.
- *
- * @param[in]   event   Event generated by button press.
- */
-void bsp_event_handler(bsp_event_t event)
-{
-    uint32_t err_code;
-    switch (event)
+    // Bandwidth of the next connections, tx_complete counts follow the buffers of the link
+    if (ble_enable_params.common_enable_params.p_conn_bw_counts != NULL)
     {
-        case BSP_EVENT_SLEEP:
-            sleep_mode_enter();
-            break;
+        ble_opt_t opt;
 
-        case BSP_EVENT_DISCONNECT:
-            err_code = sd_ble_gap_disconnect(m_conn_handle, BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
-            if (err_code != NRF_ERROR_INVALID_STATE)
-            {
-                APP_ERROR_CHECK(err_code);
-            }
-            break;
+        memset(&opt, 0, sizeof(opt));
+        opt.common_opt.conn_bw.role               = BLE_GAP_ROLE_PERIPH;
+        opt.common_opt.conn_bw.conn_bw.conn_bw_tx = PERIPHERAL_CONN_BW_TX;
+        opt.common_opt.conn_bw.conn_bw.conn_bw_rx = PERIPHERAL_CONN_BW_RX;
+        err_code = sd_ble_opt_set(BLE_COMMON_OPT_CONN_BW, &opt);
+        APP_ERROR_CHECK(err_code);
+    }
 
-        case BSP_EVENT_WHITELIST_OFF:
-            if (m_conn_handle == BLE_CONN_HANDLE_INVALID)
-            {
-                err_code = ble_advertising_restart_without_whitelist();
-                if (err_code != NRF_ERROR_INVALID_STATE)
-                {
-                    APP_ERROR_CHECK(err_code);
-                }
-            }
-            break;
+    // Subscribe for BLE events.
+    err_code = softdevice_ble_evt_handler_set(ble_evt_dispatch);
+    APP_ERROR_CHECK(err_code);
 
-        default:
-            break;
-    }
+    // Subscribe for system events, needed by flash storage.
+    err_code = softdevice_sys_evt_handler_set(sys_evt_dispatch);
+    APP_ERROR_CHECK(err_code);
 }
 
 
@@ -468,7 +688,6 @@ void uart_event_handle(app_uart_evt_t * p_event)
     //static uint8_t data_array[BLE_NUS_MAX_DATA_LEN];
     //static uint8_t index = 0;
     //uint32_t       err_code;
-    uint8_t rx;
 
     switch (p_event->evt_type)
     {
@@ -488,18 +707,17 @@ void uart_event_handle(app_uart_evt_t * p_event)
                 index = 0;
             }
 #endif
-            while (app_uart_get(&rx) == NRF_SUCCESS)
-            {
-                do_main_stm(MAIN_REASON_RX, rx);
-            }
+            ecu_uart_rx();
             break;
 
         case APP_UART_COMMUNICATION_ERROR:
             //APP_ERROR_HANDLER(p_event->data.error_communication);
+            ecu_stats.uart_comm_err++;
             break;
 
         case APP_UART_FIFO_ERROR:
             //APP_ERROR_HANDLER(p_event->data.error_code);
+            ecu_stats.uart_fifo_err++;
             break;
 
         default:
@@ -566,28 +784,6 @@ static void advertising_init(void)
 }
 
 
-/**@brief Function for initializing buttons and leds.
- *
- * @param[out] p_erase_bonds  Will be true if the clear bonding button was pressed to wake the application up.
- */
-static void buttons_leds_init(bool * p_erase_bonds)
-{
-#if 0
-    bsp_event_t startup_event;
-
-    uint32_t err_code = bsp_init(BSP_INIT_LED | BSP_INIT_BUTTONS,
-                                 APP_TIMER_TICKS(100, APP_TIMER_PRESCALER),
-                                 bsp_event_handler);
-    APP_ERROR_CHECK(err_code);
-
-    err_code = bsp_btn_ble_init(NULL, &startup_event);
-    APP_ERROR_CHECK(err_code);
-
-    *p_erase_bonds = (startup_event == BSP_EVENT_CLEAR_BONDING_DATA);
-#endif
-}
-
-
 /**@brief Function for placing the application in low power state while waiting for events.
  */
 static void power_manage(void)
@@ -602,15 +798,18 @@ static void power_manage(void)
 int main(void)
 {
     uint32_t err_code;
-    bool erase_bonds;
 
     // Initialize.
-    APP_TIMER_INIT(APP_TIMER_PRESCALER, APP_TIMER_OP_QUEUE_SIZE, false);
+    ecu_stats_stack_paint();
+    APP_SCHED_INIT(SCHED_MAX_EVENT_DATA_SIZE, SCHED_QUEUE_SIZE);
+    APP_TIMER_APPSH_INIT(APP_TIMER_PRESCALER, APP_TIMER_OP_QUEUE_SIZE, true);
     ecu_init();
     uart_init();
 
-    buttons_leds_init(&erase_bonds);
     ble_stack_init();
+    flash_store_init();
+    ecu_profile_init();
+    sys_attr_init();
     gap_params_init();
     services_init();
     advertising_init();
@@ -623,6 +822,7 @@ int main(void)
     // Enter main loop.
     for (;;)
     {
+        app_sched_execute();
         power_manage();
     }
 }
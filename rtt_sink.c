@@ -0,0 +1,21 @@
+#include <stdint.h>
+
+#include "SEGGER_RTT.h"
+
+#include "rtt_sink.h"
+
+static char rtt_buf[RTT_SINK_SIZE];
+
+void rtt_sink_init(void)
+{
+    SEGGER_RTT_ConfigUpBuffer(RTT_SINK_CHANNEL, "ecu", rtt_buf, sizeof(rtt_buf), SEGGER_RTT_MODE_NO_BLOCK_SKIP);
+}
+
+void rtt_sink_write(const uint8_t *data, int len)
+{
+    // Whole line or nothing so the capture stays parseable
+    if (SEGGER_RTT_WriteNoLock(RTT_SINK_CHANNEL, data, len) == len)
+    {
+        SEGGER_RTT_WriteNoLock(RTT_SINK_CHANNEL, "\n", 1);
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef RTT_SINK_H
+#define RTT_SINK_H
+
+#include <stdint.h>
+
+// Copy of samples, records and trace events to a SEGGER RTT up-buffer for
+// bench capture. Built in with make RTT=1, otherwise calls compile away.
+#define RTT_SINK_CHANNEL    1
+#define RTT_SINK_SIZE       1024
+
+#ifdef ECU_RTT
+
+extern void rtt_sink_init(void);
+
+// Writes data and a newline, skipped if the host is not keeping up
+extern void rtt_sink_write(const uint8_t *data, int len);
+
+#else
+
+#define rtt_sink_init()
+#define rtt_sink_write(data, len)
+
+#endif
+
+#endif
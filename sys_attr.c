@@ -0,0 +1,341 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "app_error.h"
+#include "ble_gap.h"
+#include "ble_gatts.h"
+#include "nrf_soc.h"
+
+#include "flash_store.h"
+#include "sys_attr.h"
+
+#define SYS_ATTR_MAGIC      0x53415442
+
+// Address type of an unused entry
+#define SYS_ATTR_UNUSED     0xff
+
+// Entry flags
+#define SYS_ATTR_BONDED     0x01    // LTK, EDIV and rand are valid
+#define SYS_ATTR_IRK        0x02    // central uses private addresses, resolved with irk
+#define SYS_ATTR_AUTH       0x04    // LTK is from authenticated pairing
+
+// Resolvable private address: hash in the low 3 bytes, prand in the high 3
+#define RPA_HASH_LEN        3
+#define RPA_PRAND_LEN       3
+
+// One central, its attributes and bond keys, a multiple of 4 bytes
+typedef struct
+{
+    uint8_t addr[BLE_GAP_ADDR_LEN];     // identity address if bonded
+    uint8_t addr_type;
+    uint8_t len;
+    uint8_t data[SYS_ATTR_MAX_LEN];
+    uint8_t irk[BLE_GAP_SEC_KEY_LEN];
+    uint8_t ltk[BLE_GAP_SEC_KEY_LEN];
+    uint8_t rand[BLE_GAP_SEC_RAND_LEN];
+    uint16_t ediv;
+    uint8_t ltk_len;
+    uint8_t flags;
+} sys_attr_entry_t;
+
+// Flash record, entry replaced next and the known centrals
+typedef struct
+{
+    uint32_t magic;
+    uint32_t next;
+    sys_attr_entry_t peers[SYS_ATTR_PEERS];
+} sys_attr_record_t;
+
+// Live record, and the copy flash reads until a write completes
+static sys_attr_record_t record;
+static sys_attr_record_t record_flash;
+static int record_dirty = 0;
+
+// Connected central, NULL entry if it has none yet
+static ble_gap_addr_t peer_addr;
+static sys_attr_entry_t *peer_entry = NULL;
+
+// Keys exchanged during pairing, valid until the auth status
+static ble_gap_enc_key_t bond_enc_key;
+static ble_gap_id_key_t bond_id_key;
+static ble_gap_sec_keyset_t bond_keyset;
+
+void sys_attr_init(void)
+{
+    const sys_attr_record_t *stored = (const sys_attr_record_t *) flash_store_read(FLASH_SLOT_SYS_ATTR, SYS_ATTR_MAGIC);
+    int i;
+
+    if (stored && stored->next < SYS_ATTR_PEERS)
+    {
+        record = *stored;
+        return;
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.magic = SYS_ATTR_MAGIC;
+
+    for (i = 0; i < SYS_ATTR_PEERS; i++)
+    {
+        record.peers[i].addr_type = SYS_ATTR_UNUSED;
+    }
+}
+
+void sys_attr_sync(void)
+{
+    if (!record_dirty || flash_store_busy())
+    {
+        return;
+    }
+
+    record_flash = record;
+    record_dirty = !flash_store_write(FLASH_SLOT_SYS_ATTR, (const uint32_t *) &record_flash, sizeof(record_flash) / sizeof(uint32_t));
+}
+
+static void record_save(void)
+{
+    record_dirty = 1;
+    sys_attr_sync();
+}
+
+// ah() of the Bluetooth spec with the ECB peripheral, which takes big endian data
+static int addr_resolve(const uint8_t *irk, const uint8_t *addr)
+{
+    nrf_ecb_hal_data_t ecb;
+    int i;
+
+    memset(&ecb, 0, sizeof(ecb));
+
+    for (i = 0; i < SOC_ECB_KEY_LENGTH; i++)
+    {
+        ecb.key[i] = irk[SOC_ECB_KEY_LENGTH - 1 - i];
+    }
+    for (i = 0; i < RPA_PRAND_LEN; i++)
+    {
+        ecb.cleartext[SOC_ECB_KEY_LENGTH - 1 - i] = addr[RPA_HASH_LEN + i];
+    }
+
+    if (sd_ecb_block_encrypt(&ecb) != NRF_SUCCESS)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < RPA_HASH_LEN; i++)
+    {
+        if (ecb.ciphertext[SOC_ECB_KEY_LENGTH - 1 - i] != addr[i])
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Same address, or a private address made with the IRK of a bonded central
+static sys_attr_entry_t *peer_find(void)
+{
+    int i;
+
+    for (i = 0; i < SYS_ATTR_PEERS; i++)
+    {
+        sys_attr_entry_t *entry = &record.peers[i];
+
+        if (entry->addr_type == SYS_ATTR_UNUSED)
+        {
+            continue;
+        }
+        if (entry->addr_type == peer_addr.addr_type && memcmp(entry->addr, peer_addr.addr, BLE_GAP_ADDR_LEN) == 0)
+        {
+            return entry;
+        }
+        if ((entry->flags & SYS_ATTR_IRK) && peer_addr.addr_type == BLE_GAP_ADDR_TYPE_RANDOM_PRIVATE_RESOLVABLE &&
+            addr_resolve(entry->irk, peer_addr.addr))
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+// Oldest entry is cleared for the connected central
+static sys_attr_entry_t *peer_add(void)
+{
+    sys_attr_entry_t *entry = &record.peers[record.next];
+
+    record.next = (record.next + 1) % SYS_ATTR_PEERS;
+
+    memset(entry, 0, sizeof(*entry));
+    memcpy(entry->addr, peer_addr.addr, BLE_GAP_ADDR_LEN);
+    entry->addr_type = peer_addr.addr_type;
+
+    return entry;
+}
+
+static void sec_params_get(ble_gap_sec_params_t *params)
+{
+    memset(params, 0, sizeof(*params));
+    params->bond = 1;
+    params->io_caps = BLE_GAP_IO_CAPS_NONE;
+    params->min_key_size = 7;
+    params->max_key_size = 16;
+    params->kdist_own.enc = 1;
+    params->kdist_peer.id = 1;
+}
+
+int sys_attr_restore(uint16_t conn_handle, const ble_gap_addr_t *peer)
+{
+    uint32_t err_code;
+
+    // Earlier write that found flash busy
+    sys_attr_sync();
+
+    peer_addr = *peer;
+    peer_entry = peer_find();
+
+    // Service changed CCCD and the like are not kept
+    err_code = sd_ble_gatts_sys_attr_set(conn_handle, NULL, 0, BLE_GATTS_SYS_ATTR_FLAG_SYS_SRVCS);
+    APP_ERROR_CHECK(err_code);
+
+    if (peer_entry && peer_entry->len > 0 &&
+        sd_ble_gatts_sys_attr_set(conn_handle, peer_entry->data, peer_entry->len, BLE_GATTS_SYS_ATTR_FLAG_USR_SRVCS) == NRF_SUCCESS)
+    {
+        return 1;
+    }
+
+    // Unknown central, or the attribute table changed since the entry was stored
+    err_code = sd_ble_gatts_sys_attr_set(conn_handle, NULL, 0, BLE_GATTS_SYS_ATTR_FLAG_USR_SRVCS);
+    APP_ERROR_CHECK(err_code);
+
+    // Private address changes, only a bond lets the central be found next time
+    if (peer_entry == NULL && peer->addr_type == BLE_GAP_ADDR_TYPE_RANDOM_PRIVATE_RESOLVABLE)
+    {
+        ble_gap_sec_params_t params;
+
+        sec_params_get(&params);
+        (void) sd_ble_gap_authenticate(conn_handle, &params);
+    }
+
+    return peer_entry != NULL;
+}
+
+void sys_attr_save(uint16_t conn_handle)
+{
+    uint8_t data[SYS_ATTR_MAX_LEN];
+    uint16_t len = sizeof(data);
+
+    // Unbonded private address would never match again
+    if (peer_entry == NULL && peer_addr.addr_type == BLE_GAP_ADDR_TYPE_RANDOM_PRIVATE_RESOLVABLE)
+    {
+        return;
+    }
+
+    if (sd_ble_gatts_sys_attr_get(conn_handle, data, &len, BLE_GATTS_SYS_ATTR_FLAG_USR_SRVCS) != NRF_SUCCESS)
+    {
+        return;
+    }
+
+    if (peer_entry && peer_entry->len == len && memcmp(peer_entry->data, data, len) == 0)
+    {
+        return;
+    }
+
+    if (peer_entry == NULL)
+    {
+        peer_entry = peer_add();
+    }
+
+    peer_entry->len = len;
+    memcpy(peer_entry->data, data, len);
+    record_save();
+}
+
+void sys_attr_sec_params_reply(uint16_t conn_handle)
+{
+    ble_gap_sec_params_t params;
+    uint32_t err_code;
+
+    sec_params_get(&params);
+
+    memset(&bond_keyset, 0, sizeof(bond_keyset));
+    bond_keyset.keys_own.p_enc_key = &bond_enc_key;
+    bond_keyset.keys_peer.p_id_key = &bond_id_key;
+
+    err_code = sd_ble_gap_sec_params_reply(conn_handle, BLE_GAP_SEC_STATUS_SUCCESS, &params, &bond_keyset);
+    APP_ERROR_CHECK(err_code);
+}
+
+void sys_attr_auth_status(uint16_t conn_handle, const ble_gap_evt_auth_status_t *status)
+{
+    if (status->auth_status != BLE_GAP_SEC_STATUS_SUCCESS || !status->bonded)
+    {
+        return;
+    }
+
+    if (peer_entry == NULL)
+    {
+        peer_entry = peer_add();
+    }
+
+    peer_entry->flags = SYS_ATTR_BONDED;
+    memcpy(peer_entry->ltk, bond_enc_key.enc_info.ltk, BLE_GAP_SEC_KEY_LEN);
+    peer_entry->ltk_len = bond_enc_key.enc_info.ltk_len;
+    if (bond_enc_key.enc_info.auth)
+    {
+        peer_entry->flags |= SYS_ATTR_AUTH;
+    }
+    peer_entry->ediv = bond_enc_key.master_id.ediv;
+    memcpy(peer_entry->rand, bond_enc_key.master_id.rand, BLE_GAP_SEC_RAND_LEN);
+
+    // Identity address replaces the private one, later ones resolve with the IRK
+    if (status->kdist_peer.id)
+    {
+        peer_entry->flags |= SYS_ATTR_IRK;
+        memcpy(peer_entry->irk, bond_id_key.id_info.irk, BLE_GAP_SEC_KEY_LEN);
+        memcpy(peer_entry->addr, bond_id_key.id_addr_info.addr, BLE_GAP_ADDR_LEN);
+        peer_entry->addr_type = bond_id_key.id_addr_info.addr_type;
+    }
+
+    // CCCD written before pairing goes in the same write
+    record_dirty = 1;
+    sys_attr_save(conn_handle);
+    sys_attr_sync();
+}
+
+void sys_attr_sec_info_reply(uint16_t conn_handle, const ble_gap_evt_sec_info_request_t *request)
+{
+    sys_attr_entry_t *found = NULL;
+    ble_gap_enc_info_t enc_info;
+    uint32_t err_code;
+    int i;
+
+    for (i = 0; i < SYS_ATTR_PEERS; i++)
+    {
+        sys_attr_entry_t *entry = &record.peers[i];
+
+        if (entry->addr_type != SYS_ATTR_UNUSED && (entry->flags & SYS_ATTR_BONDED) &&
+            entry->ediv == request->master_id.ediv &&
+            memcmp(entry->rand, request->master_id.rand, BLE_GAP_SEC_RAND_LEN) == 0)
+        {
+            found = entry;
+            break;
+        }
+    }
+
+    if (found)
+    {
+        memset(&enc_info, 0, sizeof(enc_info));
+        memcpy(enc_info.ltk, found->ltk, BLE_GAP_SEC_KEY_LEN);
+        enc_info.ltk_len = found->ltk_len;
+        enc_info.auth = (found->flags & SYS_ATTR_AUTH) != 0;
+
+        // Central without IRK is known by its keys, attributes are saved to its entry
+        if (peer_entry == NULL)
+        {
+            peer_entry = found;
+        }
+    }
+
+    // No keys makes the central pair again
+    err_code = sd_ble_gap_sec_info_reply(conn_handle, found ? &enc_info : NULL, NULL, NULL);
+    APP_ERROR_CHECK(err_code);
+}
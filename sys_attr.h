@@ -0,0 +1,34 @@
+#ifndef SYS_ATTR_H
+#define SYS_ATTR_H
+
+#include <stdint.h>
+
+#include "ble_gap.h"
+
+// Centrals remembered, a new one replaces the oldest entry
+#define SYS_ATTR_PEERS      4
+
+// Room for the CCCDs of the user services and the CRC
+#define SYS_ATTR_MAX_LEN    20
+
+// Functions between main.c and sys_attr.c
+
+extern void sys_attr_init(void);
+
+// Sets stored attributes of the peer or empty ones, returns 1 if the peer was known.
+// A central with an unknown private address is asked to bond, it can only be
+// recognized again through its IRK.
+extern int sys_attr_restore(uint16_t conn_handle, const ble_gap_addr_t *peer);
+
+// Stores attributes of the connected peer, flash is written only when they changed
+extern void sys_attr_save(uint16_t conn_handle);
+
+// Pairing: Just Works with bonding, own LTK and the IRK of the central are kept
+extern void sys_attr_sec_params_reply(uint16_t conn_handle);
+extern void sys_attr_auth_status(uint16_t conn_handle, const ble_gap_evt_auth_status_t *status);
+extern void sys_attr_sec_info_reply(uint16_t conn_handle, const ble_gap_evt_sec_info_request_t *request);
+
+// Retries a flash write that found flash busy
+extern void sys_attr_sync(void);
+
+#endif
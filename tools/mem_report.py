@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+# Per module flash and RAM usage from a GNU ld map file
+#
+# usage: mem_report.py <map file> [linker script]
+
+import os
+import re
+import sys
+
+FLASH_SECTIONS = ('.text', '.rodata', '.isr_vector', '.init', '.fini', '.ARM')
+DATA_SECTIONS = ('.data', '.fs_data', '.pwr_mgmt_data')
+RAM_SECTIONS = ('.bss', 'COMMON', '.heap', '.stack_dummy', '.noinit')
+
+INPUT_RE = re.compile(r'^ (\S+)?\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S+)$')
+
+
+def module_name(path):
+    # Archive members are grouped by library
+    m = re.match(r'(.*\.a)\(.*\)$', path)
+    if m:
+        return os.path.basename(m.group(1))
+    return os.path.basename(path)
+
+
+def section_type(name):
+    for prefix in FLASH_SECTIONS:
+        if name.startswith(prefix):
+            return 'flash'
+    for prefix in DATA_SECTIONS:
+        if name.startswith(prefix):
+            return 'data'
+    for prefix in RAM_SECTIONS:
+        if name.startswith(prefix):
+            return 'ram'
+    return None
+
+
+def parse_map(path):
+    modules = {}
+    in_map = False
+    pending = None
+
+    for line in open(path):
+        line = line.rstrip('\n')
+
+        if line.startswith('Linker script and memory map'):
+            in_map = True
+            continue
+        if not in_map:
+            continue
+
+        # Long section names put address and size on the next line
+        if re.match(r'^ \S+$', line):
+            pending = line.strip()
+            continue
+
+        m = INPUT_RE.match(line)
+        if not m:
+            pending = None
+            continue
+
+        name = m.group(1) or pending
+        pending = None
+        addr = int(m.group(2), 16)
+        size = int(m.group(3), 16)
+        kind = section_type(name or '')
+
+        if kind is None or addr == 0 or size == 0:
+            continue
+
+        usage = modules.setdefault(module_name(m.group(4)), [0, 0])
+        if kind in ('flash', 'data'):
+            usage[0] += size
+        if kind in ('data', 'ram'):
+            usage[1] += size
+
+    return modules
+
+
+def ram_length(path):
+    for line in open(path):
+        m = re.search(r'RAM.*ORIGIN\s*=\s*(0x[0-9a-fA-F]+),\s*LENGTH\s*=\s*(0x[0-9a-fA-F]+)', line)
+        if m:
+            return int(m.group(2), 16)
+    return None
+
+
+def main():
+    if len(sys.argv) < 2:
+        print('usage: %s <map file> [linker script]' % sys.argv[0])
+        return 1
+
+    modules = parse_map(sys.argv[1])
+    total_flash = 0
+    total_ram = 0
+
+    print('%-40s %8s %8s' % ('module', 'flash', 'ram'))
+
+    for name, usage in sorted(modules.items(), key=lambda m: (-m[1][1], -m[1][0])):
+        print('%-40s %8d %8d' % (name, usage[0], usage[1]))
+        total_flash += usage[0]
+        total_ram += usage[1]
+
+    print('%-40s %8d %8d' % ('total', total_flash, total_ram))
+
+    if len(sys.argv) > 2:
+        length = ram_length(sys.argv[2])
+        if length:
+            print('RAM region %d bytes, %d free' % (length, length - total_ram))
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
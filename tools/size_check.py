@@ -0,0 +1,273 @@
+#!/usr/bin/env python3
+# Compare firmware section sizes and worst case stack depth against a baseline
+#
+# usage: size_check.py <map file> <object dir> <baseline> [--update] [--objdump <path>]
+#
+# Baseline lines are '<key> <bytes> <allowed growth>'. Check fails when a
+# value is over bytes + allowed growth, a key without a baseline is only
+# reported. --update rewrites the baseline from the current build and keeps
+# the allowed growth of each key.
+#
+# Stack is the deepest call chain from main plus the deepest interrupt
+# handler chain, the exception frame and the SoftDevice reserve. Frame sizes
+# come from gcc -fstack-usage, call edges from objdump of the .out file next
+# to the map file. The stack also fails the check when it is over the
+# linker stack region, with or without a baseline.
+
+import os
+import re
+import subprocess
+import sys
+
+KEYS = ('text', 'data', 'bss', 'stack')
+DATA_SECTIONS = ('.data', '.fs_data', '.pwr_mgmt_data')
+BSS_SECTIONS = ('.bss',)
+DEFAULT_GROWTH = {'text': 512, 'data': 64, 'bss': 128, 'stack': 32}
+
+SECTION_RE = re.compile(r'^(\.\S+)?\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)')
+
+# Cortex-M0 exception entry stacks r0-r3, r12, lr, pc and xpsr
+EXCEPTION_FRAME = 32
+# SoftDevice worst case call stack on top of the application, from the
+# S130 and S132 specifications
+SOFTDEVICE_STACK = 1536
+
+FUNC_RE = re.compile(r'^[0-9a-f]+ <([^>]+)>:$')
+CALL_RE = re.compile(r'\s(bl|blx|b|b\.n|b\.w)\s+[0-9a-f]+ <([^>+]+)>')
+INDIRECT_RE = re.compile(r'\s(blx|bx)\s+r([0-9]|1[0-2])\b')
+
+
+def map_sizes(path):
+    sizes = {'text': 0, 'data': 0, 'bss': 0, 'stack_region': 0}
+    in_map = False
+    pending = None
+
+    for line in open(path):
+        line = line.rstrip('\n')
+
+        if line.startswith('Linker script and memory map'):
+            in_map = True
+            continue
+        if not in_map:
+            continue
+
+        # Output sections start at column 0, long names wrap to next line
+        if re.match(r'^\.\S+$', line):
+            pending = line
+            continue
+
+        m = SECTION_RE.match(line)
+        if not m or (m.group(1) is None and pending is None):
+            pending = None
+            continue
+
+        name = m.group(1) or pending
+        pending = None
+        addr = int(m.group(2), 16)
+        size = int(m.group(3), 16)
+
+        if addr == 0:
+            continue
+        if addr < 0x20000000:
+            sizes['text'] += size
+        elif name in DATA_SECTIONS:
+            sizes['data'] += size
+        elif name in BSS_SECTIONS:
+            sizes['bss'] += size
+        elif name == '.stack_dummy':
+            sizes['stack_region'] += size
+
+    return sizes
+
+
+def stack_frames(obj_dir):
+    # gcc -fstack-usage writes '<file>:<line>:<col>:<function> <bytes> <type>'
+    frames = {}
+
+    for root, dirs, files in os.walk(obj_dir):
+        for f in files:
+            if not f.endswith('.su'):
+                continue
+            for line in open(os.path.join(root, f)):
+                parts = line.split()
+                if len(parts) >= 2 and parts[-2].isdigit():
+                    # static functions of the same name count as the larger
+                    name = parts[0].split(':')[-1]
+                    frames[name] = max(frames.get(name, 0), int(parts[-2]))
+
+    return frames
+
+
+def call_graph(elf, objdump):
+    calls = {}
+    indirect = set()
+    func = None
+
+    try:
+        out = subprocess.check_output([objdump, '-d', elf], universal_newlines=True)
+    except (OSError, subprocess.CalledProcessError) as e:
+        sys.exit('cannot disassemble %s with %s: %s' % (elf, objdump, e))
+
+    for line in out.splitlines():
+        m = FUNC_RE.match(line)
+        if m:
+            func = m.group(1)
+            calls[func] = set()
+            continue
+        if func is None:
+            continue
+
+        m = CALL_RE.search(line)
+        if m and m.group(2) != func:
+            # plain branches to another symbol are tail calls
+            calls[func].add(m.group(2))
+        elif INDIRECT_RE.search(line):
+            indirect.add(func)
+
+    return calls, indirect
+
+
+def stack_depth(frames, calls, indirect):
+    depth = {}
+    cycles = set()
+    unknown = set()
+
+    def walk(func, path):
+        if func in depth:
+            return depth[func]
+        if func in path:
+            cycles.add(func)
+            return (0, [])
+        if func not in frames:
+            unknown.add(func)
+
+        path.add(func)
+        deepest = (0, [])
+        for callee in calls.get(func, ()):
+            d = walk(callee, path)
+            if d[0] > deepest[0]:
+                deepest = d
+        path.discard(func)
+
+        depth[func] = (frames.get(func, 0) + deepest[0], [func] + deepest[1])
+        return depth[func]
+
+    # deepest stack on entry to each function reached from main, so an
+    # indirect call is counted where it is made
+    reach = {}
+
+    def enter(func, used, path):
+        if used <= reach.get(func, -1) or func in path:
+            return
+        reach[func] = used
+        path.add(func)
+        for callee in calls.get(func, ()):
+            enter(callee, used + frames.get(func, 0), path)
+        path.discard(func)
+
+    enter('main', 0, set())
+
+    called = set()
+    for callees in calls.values():
+        called |= callees
+
+    handlers = [f for f in calls if f.endswith('Handler') and f != 'Reset_Handler']
+    # Functions never called directly are reached through pointers from the
+    # scheduler, timers and event dispatch; any of them can run at the
+    # deepest indirect call site
+    pointed = [f for f in calls
+               if f not in called and f not in handlers and f != 'main'
+               and not f.startswith('_') and f != 'Reset_Handler']
+
+    main = walk('main', set())
+    isr = max([walk(f, set()) for f in handlers] or [(0, [])])
+    target = max([walk(f, set()) for f in pointed] or [(0, [])])
+    site = max([(reach[f] + frames.get(f, 0), f) for f in indirect if f in reach] or [(0, '')])
+    through = (site[0] + target[0], ['main', '..', site[1]] + target[1])
+
+    return {
+        'main': main,
+        'isr': isr,
+        'indirect': through,
+        'cycles': cycles,
+        'unknown': unknown,
+    }
+
+
+def read_baseline(path):
+    baseline = {}
+
+    for line in open(path):
+        line = line.split('#')[0].split()
+        if len(line) == 3 and line[0] in KEYS:
+            baseline[line[0]] = (int(line[1]), int(line[2]))
+
+    return baseline
+
+
+def write_baseline(path, values, baseline):
+    out = open(path, 'w')
+    out.write('# Firmware size baseline, checked by make size_check\n')
+    out.write('# Regenerate with make size_baseline when growth is intended\n')
+    out.write('# key      bytes  allowed growth\n')
+    for key in KEYS:
+        growth = baseline.get(key, (0, DEFAULT_GROWTH[key]))[1]
+        out.write('%-8s %7d %7d\n' % (key, values[key], growth))
+    out.close()
+
+
+def main():
+    args = sys.argv[1:]
+    objdump = 'arm-none-eabi-objdump'
+    if '--objdump' in args:
+        i = args.index('--objdump')
+        objdump = args[i + 1]
+        del args[i:i + 2]
+
+    if len(args) < 3:
+        print('usage: %s <map file> <object dir> <baseline> [--update] [--objdump <path>]' % sys.argv[0])
+        return 1
+
+    values = map_sizes(args[0])
+    calls, indirect = call_graph(os.path.splitext(args[0])[0] + '.out', objdump)
+    stack = stack_depth(stack_frames(args[1]), calls, indirect)
+    thread = max(stack['main'], stack['indirect'])
+    values['stack'] = thread[0] + stack['isr'][0] + EXCEPTION_FRAME + SOFTDEVICE_STACK
+    baseline = read_baseline(args[2])
+
+    if '--update' in args[3:]:
+        write_baseline(args[2], values, baseline)
+        print('baseline updated')
+        return 0
+
+    failed = 0
+    print('%-8s %8s %8s %8s' % ('', 'current', 'baseline', 'limit'))
+
+    for key in KEYS:
+        if key not in baseline:
+            print('%-8s %8d %8s %8s no baseline, run make size_baseline' % (key, values[key], '-', '-'))
+            continue
+        base, growth = baseline[key]
+        limit = base + growth
+        status = ''
+        if values[key] > limit:
+            status = 'FAIL'
+            failed = 1
+        print('%-8s %8d %8d %8d %s' % (key, values[key], base, limit, status))
+
+    print('stack: thread %d + interrupt %d + exception frame %d + SoftDevice %d' %
+          (thread[0], stack['isr'][0], EXCEPTION_FRAME, SOFTDEVICE_STACK))
+    print('  thread chain: %s' % ' > '.join(thread[1]))
+    print('  interrupt chain: %s' % ' > '.join(stack['isr'][1]))
+    if values['stack_region'] and values['stack'] > values['stack_region']:
+        print('FAIL: worst case stack over the %d byte stack region' % values['stack_region'])
+        failed = 1
+    if stack['cycles']:
+        print('recursion not counted: %s' % ', '.join(sorted(stack['cycles'])))
+    if stack['unknown']:
+        print('no frame size: %s' % ', '.join(sorted(stack['unknown'])))
+    return failed
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,48 @@
+#!/usr/bin/env python3
+# Decode trace events from captured dash data
+#
+# usage: trace_decode.py <trace.h> < capture
+#
+# Dash data is split into records at ':', '!' and '#'. Events are '#' + 2 hex
+# id + 6 hex RTC1 ticks + 8 hex arg, other records are passed through.
+
+import re
+import sys
+
+
+def event_names(path):
+    names = {}
+    for line in open(path):
+        m = re.match(r'#define\s+TRACE_(\w+)\s+(0x[0-9a-fA-F]+)', line)
+        if m:
+            names[int(m.group(2), 16)] = m.group(1).lower()
+    return names
+
+
+def main():
+    if len(sys.argv) < 2:
+        print('usage: %s <trace.h> < capture' % sys.argv[0])
+        return 1
+
+    names = event_names(sys.argv[1])
+    event = re.compile(r'#([0-9A-F]{2})([0-9A-F]{6})([0-9A-F]{8})')
+
+    data = sys.stdin.read().replace('\r', '').replace('\n', '')
+
+    for rec in re.split(r'(?=[:+*!#])', data):
+        m = event.fullmatch(rec)
+        if not m:
+            if rec:
+                print(rec)
+            continue
+
+        eid = int(m.group(1), 16)
+        ticks = int(m.group(2), 16)
+        arg = int(m.group(3), 16)
+        print('%10.3f %-12s %08x' % (ticks / 32768.0, names.get(eid, 'id%02x' % eid), arg))
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,77 @@
+#include <stdint.h>
+
+#include "app_timer.h"
+#include "ble_nus.h"
+
+#include "ecu_msg.h"
+#include "rtt_sink.h"
+#include "trace.h"
+#include "upstream.h"
+
+static const char TO_HEX[] = "0123456789ABCDEF";
+
+static trace_entry_t trace_ring[TRACE_RING_SIZE];
+static uint32_t trace_head = 0;
+static uint32_t trace_sent = 0;
+
+static char *put_hex(char *ptr, uint32_t v, int digits)
+{
+    while (digits--)
+    {
+        *ptr++ = TO_HEX[(v >> (digits * 4)) & 0xf];
+    }
+    return ptr;
+}
+
+// '#' + id and RTC1 ticks + arg, returns end of data
+static char *trace_encode(char *ptr, const trace_entry_t *entry)
+{
+    *ptr++ = '#';
+    ptr = put_hex(ptr, entry->time_id, 8);
+    return put_hex(ptr, entry->arg, 8);
+}
+
+void trace_event(uint8_t id, uint32_t arg)
+{
+    trace_entry_t *entry = &trace_ring[trace_head % TRACE_RING_SIZE];
+    uint32_t now;
+
+    app_timer_cnt_get(&now);
+    entry->time_id = ((uint32_t) id << 24) | (now & 0xffffff);
+    entry->arg = arg;
+    trace_head++;
+
+#ifdef ECU_RTT
+    {
+        char buf[1 + 8 + 8];
+        rtt_sink_write((const uint8_t *) buf, trace_encode(buf, entry) - buf);
+    }
+#endif
+
+    trace_flush();
+}
+
+void trace_flush(void)
+{
+    // Oldest events were overwritten while waiting
+    if (trace_head - trace_sent > TRACE_RING_SIZE)
+    {
+        trace_sent = trace_head - TRACE_RING_SIZE;
+    }
+
+    // Kept in ring until dash connects
+    if (nus_get_conn_handle() == BLE_CONN_HANDLE_INVALID)
+    {
+        return;
+    }
+
+    while (trace_sent != trace_head && frame_available() > TRACE_FRAME_RESERVE)
+    {
+        trace_entry_t *entry = &trace_ring[trace_sent % TRACE_RING_SIZE];
+        frame_t *frame = frame_alloc();
+        frame->length = trace_encode((char *) frame->data, entry) - (char *) frame->data;
+
+        upstream_send(frame);
+        trace_sent++;
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Events are kept in RAM and streamed to dash as '#' + id + RTC1 ticks + arg
+// in hex. tools/trace_decode.py reads the names below.
+#define TRACE_RING_SIZE     32
+
+// Free frames left for samples, trace waits in the ring for the queue to drain
+#define TRACE_FRAME_RESERVE 2
+
+#define TRACE_SESSION       0x01    // arg: 1 dash connected, 0 disconnected
+#define TRACE_REINIT        0x02    // arg: watchdog reinit count
+#define TRACE_SCAN_START    0x03    // arg: ECU id hash
+#define TRACE_SCAN_CACHED   0x04    // arg: tables in cached map
+#define TRACE_SCAN_DONE     0x05    // arg: tables found
+#define TRACE_MSG_ERR       0x06    // arg: main state
+#define TRACE_REQ_RETRY     0x07    // arg: retry count
+#define TRACE_POLL_BACKOFF  0x08    // arg: new poll gap in ms
+#define TRACE_TX_BUFFERS    0x09    // arg: SoftDevice TX buffers of the new link
+#define TRACE_RAM_START     0x0a    // arg: RAM start needed for high bandwidth, link runs mid
+
+typedef struct
+{
+    uint32_t time_id;   // event id in top byte, RTC1 ticks below
+    uint32_t arg;
+} trace_entry_t;
+
+// Functions between ecu_msg.c and trace.c
+
+extern void trace_event(uint8_t id, uint32_t arg);
+
+// Streams pending events, retried when frames are free again
+extern void trace_flush(void);
+
+#endif
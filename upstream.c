@@ -0,0 +1,254 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "app_error.h"
+#include "app_timer.h"
+#include "ble_nus.h"
+
+#include "ecu_msg.h"
+#include "ecu_stats.h"
+#include "trace.h"
+#include "upstream.h"
+
+static frame_t pool[FRAME_POOL_SIZE];
+static frame_t *free_list = NULL;
+static int free_count = 0;
+static frame_t *queue_head = NULL;
+static frame_t *queue_tail = NULL;
+static int tx_free = 0;
+static int coalesce_armed = 0;
+
+// Latency budget in RTC1 ticks (32768 Hz)
+#define COALESCE_TICKS      ((32768 * UPSTREAM_COALESCE_MS) / 1000)
+
+APP_TIMER_DEF(coalesce_timer);
+
+static void coalesce_timeout(void * p_context);
+
+void upstream_init(void)
+{
+    uint32_t err_code;
+
+    free_list = NULL;
+    free_count = 0;
+    queue_head = NULL;
+    queue_tail = NULL;
+    coalesce_armed = 0;
+
+    for (int i = 0; i < FRAME_POOL_SIZE; i++)
+    {
+        frame_free(&pool[i]);
+    }
+
+    err_code = app_timer_create(&coalesce_timer, APP_TIMER_MODE_SINGLE_SHOT, coalesce_timeout);
+    APP_ERROR_CHECK(err_code);
+}
+
+frame_t *frame_alloc(void)
+{
+    frame_t *frame = free_list;
+
+    if (frame == NULL)
+    {
+        ecu_stats.notify_drop++;
+        return NULL;
+    }
+
+    free_list = frame->next;
+    free_count--;
+    frame->next = NULL;
+    frame->length = 0;
+    frame->sent = 0;
+    return frame;
+}
+
+void frame_free(frame_t *frame)
+{
+    frame->next = free_list;
+    free_list = frame;
+    free_count++;
+}
+
+int frame_available(void)
+{
+    return free_count;
+}
+
+void upstream_send(frame_t *frame)
+{
+    frame->next = NULL;
+    frame->sent = 0;
+    app_timer_cnt_get(&frame->time);
+
+    if (queue_tail)
+    {
+        queue_tail->next = frame;
+    }
+    else
+    {
+        queue_head = frame;
+    }
+    queue_tail = frame;
+
+    upstream_flush();
+}
+
+// Copies the next notification from the queue without consuming it, bytes of
+// consecutive frames share a packet
+static int packet_fill(uint8_t *packet)
+{
+    int n = 0;
+
+    for (frame_t *frame = queue_head; frame && n < BLE_NUS_MAX_DATA_LEN; frame = frame->next)
+    {
+        int sz = frame->length - frame->sent;
+
+        if (sz > BLE_NUS_MAX_DATA_LEN - n)
+        {
+            sz = BLE_NUS_MAX_DATA_LEN - n;
+        }
+
+        memcpy(&packet[n], &frame->data[frame->sent], sz);
+        n += sz;
+    }
+
+    return n;
+}
+
+// Frees frames once all their bytes have been sent
+static void packet_sent(int n)
+{
+    while (n > 0)
+    {
+        frame_t *frame = queue_head;
+        int sz = frame->length - frame->sent;
+
+        if (sz > n)
+        {
+            sz = n;
+        }
+
+        frame->sent += sz;
+        n -= sz;
+
+        if (frame->sent >= frame->length)
+        {
+            queue_head = frame->next;
+            if (queue_head == NULL)
+            {
+                queue_tail = NULL;
+            }
+            frame_free(frame);
+        }
+    }
+}
+
+// Ticks left before a partial packet has to go, 0 if it is due now
+static uint32_t coalesce_left(void)
+{
+    uint32_t now;
+    uint32_t age;
+
+    app_timer_cnt_get(&now);
+    app_timer_cnt_diff_compute(now, queue_head->time, &age);
+
+    return age < COALESCE_TICKS ? COALESCE_TICKS - age : 0;
+}
+
+static void coalesce_timeout(void * p_context)
+{
+    // Scheduler context like the rest of upstream
+    coalesce_armed = 0;
+    upstream_flush();
+}
+
+void upstream_flush(void)
+{
+    while (queue_head)
+    {
+        uint8_t packet[BLE_NUS_MAX_DATA_LEN];
+        int n = packet_fill(packet);
+        uint32_t left;
+        uint32_t err_code;
+
+        // Wait for more data to fill the packet, at most the latency budget
+        if (n < BLE_NUS_MAX_DATA_LEN && (left = coalesce_left()) > 0)
+        {
+            if (!coalesce_armed)
+            {
+                if (left < APP_TIMER_MIN_TIMEOUT_TICKS)
+                {
+                    left = APP_TIMER_MIN_TIMEOUT_TICKS;
+                }
+
+                coalesce_armed = 1;
+                err_code = app_timer_start(coalesce_timer, left, NULL);
+                APP_ERROR_CHECK(err_code);
+            }
+            return;
+        }
+
+        err_code = ble_nus_string_send(nus_get_service(), packet, n);
+
+        if (err_code == BLE_ERROR_NO_TX_PACKETS)
+        {
+            // Continued from BLE_EVT_TX_COMPLETE
+            tx_free = 0;
+            return;
+        }
+
+        if (err_code == NRF_SUCCESS)
+        {
+            packet_sent(n);
+            if (tx_free > 0)
+            {
+                tx_free--;
+            }
+        }
+        else
+        {
+            // Not connected or notifications disabled, frame is lost
+            ecu_stats.notify_drop++;
+            packet_sent(queue_head->length - queue_head->sent);
+        }
+    }
+}
+
+void upstream_connected(uint16_t conn_handle)
+{
+    uint8_t count = 0;
+
+    // Buffer count follows the bandwidth configured for the link
+    sd_ble_tx_packet_count_get(conn_handle, &count);
+    tx_free = count;
+    trace_event(TRACE_TX_BUFFERS, count);
+}
+
+void upstream_tx_complete(int count)
+{
+    tx_free += count;
+    upstream_flush();
+}
+
+// RTC1 ticks the oldest queued frame has waited for SoftDevice buffers
+uint32_t upstream_delay(void)
+{
+    uint32_t now;
+    uint32_t delay;
+
+    if (queue_head == NULL)
+    {
+        return 0;
+    }
+
+    app_timer_cnt_get(&now);
+    app_timer_cnt_diff_compute(now, queue_head->time, &delay);
+    return delay;
+}
+
+// SoftDevice buffers not yet filled by notifications
+int upstream_tx_free(void)
+{
+    return tx_free;
+}
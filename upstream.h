@@ -0,0 +1,47 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stdint.h>
+
+// Frame buffers shared by UART receive, hex encoding and notifications
+#define FRAME_POOL_SIZE     8
+#define FRAME_DATA_SIZE     80
+
+// Partial notifications wait this long for more data before they are sent, 0 sends at once
+#ifndef UPSTREAM_COALESCE_MS
+#define UPSTREAM_COALESCE_MS    10
+#endif
+
+typedef struct frame_s
+{
+    struct frame_s *next;
+    uint32_t time;                  // RTC1 ticks when queued
+    uint8_t length;
+    uint8_t sent;
+    uint8_t data[FRAME_DATA_SIZE];
+} frame_t;
+
+// Functions between main.c, ecu_msg.c and upstream.c
+
+extern void upstream_init(void);
+
+// Returns NULL and counts a dropped notification if the pool is empty
+extern frame_t *frame_alloc(void);
+extern void frame_free(frame_t *frame);
+extern int frame_available(void);       // number of free frames
+
+// Queues frame to dash, the queue owns the frame until it has been sent
+extern void upstream_send(frame_t *frame);
+
+// Sends queued data, called again when the SoftDevice has free buffers
+extern void upstream_flush(void);
+
+// SoftDevice buffer accounting, from BLE_GAP_EVT_CONNECTED and BLE_EVT_TX_COMPLETE
+extern void upstream_connected(uint16_t conn_handle);
+extern void upstream_tx_complete(int count);
+
+// Congestion feedback for the poll scheduler
+extern uint32_t upstream_delay(void);
+extern int upstream_tx_free(void);
+
+#endif